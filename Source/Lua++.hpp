@@ -3,17 +3,38 @@
 
 // STL
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#include <optional>
+#endif
+#if __cplusplus >= 202002L
+#include <span>
+#endif
 #include <exception>
 #include <list>
+#include <vector>
+#include <array>
 #include <map>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <chrono>
 #include <sstream>
+#include <fstream>
 #include <functional>
 #include <tuple>
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
 #include <limits>
 #include <type_traits>
 
@@ -26,8 +47,11 @@ namespace Lua
 	
 	namespace Extensions
 	{
-		template <typename T>
+		template <typename T, typename Enable = void>
 		struct AllowedType;
+		
+		template <typename T>
+		T* ToObject(lua_State* L, int index);
 	}
 
 	// TODO too much repetitive code
@@ -43,6 +67,87 @@ namespace Lua
 		struct gens<0, S...> {
 			typedef seq<S...> type;
 		};
+		
+		// C++ exceptions mustn't unwind through Lua's C frames, so they are raised as Lua errors at the boundary
+		template <lua_CFunction func>
+		int Protected(lua_State* L)
+		{
+			try
+			{
+				return func(L);
+			}
+			catch (std::exception& ex)
+			{
+				lua_pushstring(L, ex.what());
+			}
+			catch (...)
+			{
+				lua_pushstring(L, "unknown C++ exception");
+			}
+			return lua_error(L);
+		}
+		
+		// pushes what a call returned and gives the count: tuples and pairs as one value per element,
+		// so several results need no table, and nothing for void
+		template <typename Ret>
+		struct Returns
+		{
+			static int Push(lua_State* L, const Ret& value)
+			{
+				Extensions::AllowedType<typename std::decay<Ret>::type>::Push(L, value);
+				return 1;
+			}
+			template <typename Call>
+			static int push(lua_State* L, const Call& call)
+			{
+				return Push(L, call());
+			}
+		};
+		template <typename... T>
+		struct Returns<std::tuple<T...>>
+		{
+			template <int... N>
+			static void PushEach(lua_State* L, const std::tuple<T...>& value, seq<N...>)
+			{
+				int pushed[] = { 0, (Extensions::AllowedType<typename std::decay<T>::type>::Push(L, std::get<N>(value)), 0)... };
+				(void)pushed;
+			}
+			static int Push(lua_State* L, const std::tuple<T...>& value)
+			{
+				PushEach(L, value, typename gens<sizeof...(T)>::type());
+				return sizeof...(T);
+			}
+			template <typename Call>
+			static int push(lua_State* L, const Call& call)
+			{
+				return Push(L, call());
+			}
+		};
+		template <typename A, typename B>
+		struct Returns<std::pair<A, B>>
+		{
+			static int Push(lua_State* L, const std::pair<A, B>& value)
+			{
+				Extensions::AllowedType<typename std::decay<A>::type>::Push(L, value.first);
+				Extensions::AllowedType<typename std::decay<B>::type>::Push(L, value.second);
+				return 2;
+			}
+			template <typename Call>
+			static int push(lua_State* L, const Call& call)
+			{
+				return Push(L, call());
+			}
+		};
+		template <>
+		struct Returns<void>
+		{
+			template <typename Call>
+			static int push(lua_State* L, const Call& call)
+			{
+				call();
+				return 0;
+			}
+		};
 
 		template <typename Ret>
 		struct FunctionWrapper
@@ -52,25 +157,26 @@ namespace Lua
 			{
 				typedef Ret(Clazz::*Func)(Args...);
 				template <int... N>
-				static void push(lua_State* L, Clazz* self, Func func, seq<N...>)
+				static int push(lua_State* L, Clazz* self, Func func, seq<N...>)
 				{
-					Extensions::AllowedType<typename std::remove_reference<Ret>::type>::Push(L, 
-						(self->*func)(Extensions::AllowedType<typename std::remove_reference<Args>::type>::GetParameter(L, N + 2)...));
+					return Returns<Ret>::Push(L,
+						(self->*func)(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 2)...));
 				}
 				static int invoke(lua_State* L)
 				{
 					Func func;
 					memcpy(&func, lua_touserdata(L, lua_upvalueindex(1)), sizeof(Func));
-					Clazz* self = static_cast<Clazz*>(lua_touserdata(L, 1));
+					Clazz* self = Extensions::ToObject<Clazz>(L, 1);
+					if (!self)
+						return luaL_argerror(L, 1, "object expected");
 					typedef typename gens<sizeof...(Args)>::type counter;
-					push(L, self, func, counter());
-					return 1;
+					return push(L, self, func, counter());
 				}
 
 				static bool store(lua_State* L, Func func)
 				{
 					memcpy(lua_newuserdata(L, sizeof(Func)), &func, sizeof(Func));
-					lua_pushcclosure(L, invoke, 1);
+					lua_pushcclosure(L, Protected<invoke>, 1);
 					return true;
 				}
 			};
@@ -80,25 +186,23 @@ namespace Lua
 			{
 				typedef Ret(*Func)(Args...);
 				template <int... N>
-				static void push(lua_State* L, Func func, seq<N...>)
+				static int push(lua_State* L, Func func, seq<N...>)
 				{
-					Extensions::AllowedType<typename std::remove_reference<Ret>::type>::Push(L,
-						func(Extensions::AllowedType<typename std::remove_reference<Args>::type>::GetParameter(L, N + 1)...));
+					return Returns<Ret>::Push(L,
+						func(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 1)...));
 				}
 				static int invoke(lua_State* L)
 				{
 					Func func;
 					memcpy(&func, lua_touserdata(L, lua_upvalueindex(1)), sizeof(Func));
-					int count = lua_gettop(L);
 					typedef typename gens<sizeof...(Args)>::type counter;
-					push(L, func, counter());
-					return 1;
+					return push(L, func, counter());
 				}
 
 				static bool store(lua_State* L, Func func)
 				{
 					memcpy(lua_newuserdata(L, sizeof(Func)), &func, sizeof(Func));
-					lua_pushcclosure(L, invoke, 1);
+					lua_pushcclosure(L, Protected<invoke>, 1);
 					return true;
 				}
 			};
@@ -113,13 +217,15 @@ namespace Lua
 				template <int... N>
 				static void push(lua_State* L, Clazz* self, Func func, seq<N...>)
 				{
-					(self->*func)(Extensions::AllowedType<typename std::remove_reference<Args>::type>::GetParameter(L, N + 2)...);
+					(self->*func)(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 2)...);
 				}
 				static int invoke(lua_State* L)
 				{
 					Func func;
 					memcpy(&func, lua_touserdata(L, lua_upvalueindex(1)), sizeof(Func));
-					Clazz* self = static_cast<Clazz*>(lua_touserdata(L, 1));
+					Clazz* self = Extensions::ToObject<Clazz>(L, 1);
+					if (!self)
+						return luaL_argerror(L, 1, "object expected");
 					typedef typename  gens<sizeof...(Args)>::type counter;
 					push(L, self, func, counter());
 					return 0;
@@ -128,7 +234,7 @@ namespace Lua
 				static bool store(lua_State* L, Func func)
 				{
 					memcpy(lua_newuserdata(L, sizeof(Func)), &func, sizeof(Func));
-					lua_pushcclosure(L, invoke, 1);
+					lua_pushcclosure(L, Protected<invoke>, 1);
 					return true;
 				}
 			};
@@ -140,7 +246,7 @@ namespace Lua
 				template <int... N>
 				static void push(lua_State* L, Func func, seq<N...>)
 				{
-					func(Extensions::AllowedType<typename std::remove_reference<Args>::type>::GetParameter(L, N + 1)...);
+					func(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 1)...);
 				}
 				static int invoke(lua_State* L)
 				{
@@ -154,11 +260,106 @@ namespace Lua
 				static bool store(lua_State* L, Func func)
 				{
 					memcpy(lua_newuserdata(L, sizeof(Func)), &func, sizeof(Func));
-					lua_pushcclosure(L, invoke, 1);
+					lua_pushcclosure(L, Protected<invoke>, 1);
 					return true;
 				}
 			};
 		};
+		
+		// the same calls with the function as a template argument, so invoke() is a plain lua_CFunction
+		// that calls it directly, rather than fetching a pointer out of an upvalue
+		template <typename Func, Func func>
+		struct Dispatch;
+		
+		template <typename Ret, typename... Args, Ret(*func)(Args...)>
+		struct Dispatch<Ret(*)(Args...), func>
+		{
+			template <int... N>
+			static int call(lua_State* L, seq<N...>)
+			{
+				return Returns<Ret>::push(L, [L]() -> Ret {
+					return func(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 1)...);
+				});
+			}
+			static int invoke(lua_State* L)
+			{
+				return call(L, typename gens<sizeof...(Args)>::type());
+			}
+		};
+		
+		template <typename Clazz, typename Ret, typename... Args>
+		struct MemberDispatch
+		{
+			template <typename Func, int... N>
+			static int call(lua_State* L, Func func, seq<N...>)
+			{
+				Clazz* self = Extensions::ToObject<Clazz>(L, 1);
+				if (!self)
+					return luaL_argerror(L, 1, "object expected");
+				
+				return Returns<Ret>::push(L, [L, self, func]() -> Ret {
+					return (self->*func)(Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 2)...);
+				});
+			}
+		};
+		
+		template <typename Clazz, typename Ret, typename... Args, Ret(Clazz::*func)(Args...)>
+		struct Dispatch<Ret(Clazz::*)(Args...), func>
+		{
+			static int invoke(lua_State* L)
+			{
+				return MemberDispatch<Clazz, Ret, Args...>::call(L, func, typename gens<sizeof...(Args)>::type());
+			}
+		};
+		
+		template <typename Clazz, typename Ret, typename... Args, Ret(Clazz::*func)(Args...) const>
+		struct Dispatch<Ret(Clazz::*)(Args...) const, func>
+		{
+			static int invoke(lua_State* L)
+			{
+				return MemberDispatch<const Clazz, Ret, Args...>::call(L, func, typename gens<sizeof...(Args)>::type());
+			}
+		};
+		
+		// a data member, read with (self) and written with (self, value)
+		template <typename Member, Member member>
+		struct Property;
+		
+		template <typename Clazz, typename Type, Type Clazz::*member>
+		struct Property<Type Clazz::*, member>
+		{
+			static int get(lua_State* L)
+			{
+				Clazz* self = Extensions::ToObject<Clazz>(L, 1);
+				if (!self)
+					return luaL_argerror(L, 1, "object expected");
+				Extensions::AllowedType<typename std::decay<Type>::type>::Push(L, self->*member);
+				return 1;
+			}
+			static int set(lua_State* L)
+			{
+				Clazz* self = Extensions::ToObject<Clazz>(L, 1);
+				if (!self)
+					return luaL_argerror(L, 1, "object expected");
+				self->*member = Extensions::AllowedType<typename std::decay<Type>::type>::GetParameter(L, 2);
+				return 0;
+			}
+		};
+		
+		template <typename Clazz, typename... Args>
+		struct Constructor
+		{
+			template <int... N>
+			static void call(lua_State* L, seq<N...>)
+			{
+				Extensions::AllowedType<Clazz>::Emplace(L, Extensions::AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 1)...);
+			}
+			static int invoke(lua_State* L)
+			{
+				call(L, typename gens<sizeof...(Args)>::type());
+				return 1;
+			}
+		};
 	}
 
 	class Exception : public std::exception
@@ -166,7 +367,7 @@ namespace Lua
 		string _what;
 	public:
 		Exception(const string& what) : std::exception(), _what(what) {}
-		const char* what()
+		const char* what() const noexcept override
 		{
 			return _what.c_str();
 		}
@@ -204,10 +405,99 @@ namespace Lua
 		LuaTable(){}
 	};
 	
+	// contiguous memory to push as, or read a Lua array into, without going through a container
+	template<typename T>
+	struct Span
+	{
+		T* Data;
+		size_t Size;
+		
+		Span(T* data, size_t size) : Data(data), Size(size) {}
+		template<size_t N>
+		Span(T (&data)[N]) : Data(data), Size(N) {}
+		template<typename Container, typename = decltype(std::declval<Container&>().data())>
+		Span(Container& data) : Data(data.data()), Size(data.size()) {}
+	};
+	
 	class State;
 	class Reference;
 	class Variable;
+	
+	// a typed view over contiguous memory, pushed as a userdata that Lua indexes like an array (1-based)
+	// without copying; the memory is either the caller's, who must keep it alive while Lua can see it,
+	// or owned by the userdata itself when made with Buffer::New
+	template<typename T>
+	class Buffer
+	{
+		static_assert(std::is_arithmetic<T>::value, "Buffer elements must be arithmetic");
+	public:
+		static const size_t Alignment = 64; // of the memory owned by a Buffer::New userdata
+		
+		T* Data;
+		size_t Size;
+		
+		Buffer(T* data, size_t size) : Data(data), Size(size) {}
+		template<typename Container, typename = decltype(std::declval<Container&>().data())>
+		Buffer(Container& data) : Data(data.data()), Size(data.size()) {}
+		
+		T& operator[](size_t index) const { return Data[index]; }
+		T* begin() const { return Data; }
+		T* end() const { return Data + Size; }
+		
+		// a zeroed buffer of size elements living inside the userdata
+		static Variable New(State* state, size_t size);
+	};
+	
 	class ReturnValue;
+	template<typename Parent, typename Key> class Proxy;
+	class Globals;
+	template<typename T> class ClassBuilder;
+	class StackRef;
+	class StackRange;
+	class PairsRange;
+	class IPairsRange;
+	
+	// how a key is held by a Proxy, string literals are kept as const char*
+	template<typename T>
+	using ProxyKey = typename std::decay<const T>::type;
+	
+	// what a typed Call<R...>() returns: nothing, the one value, or a tuple of them;
+	// results are converted straight off the stack, so they must own their data (string, not const char*)
+	template<typename... R>
+	struct CallResult
+	{
+		typedef std::tuple<R...> type;
+		static const int Count = sizeof...(R);
+		
+		static type Read(lua_State* L, int first)
+		{
+			return Read(L, first, typename CppFunction::gens<sizeof...(R)>::type());
+		}
+		template<int... N>
+		static type Read(lua_State* L, int first, CppFunction::seq<N...>)
+		{
+			return type(Extensions::AllowedType<typename std::decay<R>::type>::GetParameter(L, first + N)...);
+		}
+	};
+	template<typename R>
+	struct CallResult<R>
+	{
+		typedef R type;
+		static const int Count = 1;
+		
+		static type Read(lua_State* L, int first)
+		{
+			return Extensions::AllowedType<typename std::decay<R>::type>::GetParameter(L, first);
+		}
+	};
+	template<>
+	struct CallResult<>
+	{
+		typedef void type;
+		static const int Count = 0;
+		
+		static void Read(lua_State* L, int first) {}
+	};
 	
 	typedef std::function<std::vector<Variable>(State*, std::vector<Variable>&)> CFunction;
 	
@@ -220,30 +510,50 @@ namespace Lua
 			typedef decltype(Extensions::AllowedType<T>::GetFromVar(Variable(nullptr))) type;
 		};
 	public:
-		Type                         _Type;
+		// strings up to this length are copied into the Variable, longer ones stay pinned in Lua
+		// and are read in place, without a copy
+		static const size_t ShortStringLength = 23;
+
+		struct KeyBinding; // the table and key a Variable was indexed from, so it can be assigned to
+		struct PinnedString
+		{
+			Reference* Ref;
+			const char* Chars;
+			size_t Length;
+		};
+
 		State*                       _State;
-		std::shared_ptr<Variable>    _Key;
-		std::shared_ptr<Reference>   _KeyTo;
-		bool                         _Global;
-		bool                         _Registry;
-		
-		bool _IsReference;
-		std::shared_ptr<Reference> Ref;
-		string String;
+		KeyBinding*                  _Key;
 		
 		union {
-			int Integer;
+			lua_Integer Integer; // when _IsInteger, otherwise Real
 			double Real;
 			bool Boolean;
 			void* Pointer;
+			Reference* Ref;
+			PinnedString String;
+			char ShortString[ShortStringLength + 1];
 		} Data;
 		
+		Type                         _Type;
+		unsigned char                _ShortLength;
+		bool                         _Global;
+		bool                         _Registry;
+		bool                         _IsInteger;
+		
 	protected:
 		inline Variable(State* state);
 		inline void SetAsStack(int index);
+		inline void CopyValue(const Variable& val);
+		inline void ReleaseValue();
+		inline string KeyName() const;
+
+		template<typename Parent, typename Key> friend class Proxy;
 
 	public:
 		inline Variable(State* state, Type type);
+		inline Variable(const Variable& other);
+		inline Variable(Variable&& other);
 
 		template <typename T>
 		Variable(State* state, const T& value);
@@ -266,7 +576,7 @@ namespace Lua
 		
 		// for table
 		template<typename T>
-		Variable operator[](const T& val);
+		Proxy<Variable, ProxyKey<T>> operator[](const T& val) const;
 		
 		bool operator==(const Variable& other) const; // from these 2 methods, the rest must be drived
 		bool operator<(const Variable& other) const; /// from ...
@@ -281,7 +591,7 @@ namespace Lua
 		
 		inline ~Variable();
 	
-		inline void SetKey(std::shared_ptr<Variable> key, Variable* to);
+		inline void SetKey(const Variable& key, const Variable& table);
 		
 		inline Type GetType() const;
 		inline string GetTypeName() const;
@@ -292,6 +602,22 @@ namespace Lua
 			return _Type == Type::Nil;
 		}
 		
+		// a number that was a Lua integer (always false before Lua 5.3)
+		bool IsInteger() const
+		{
+			return _Type == Type::Number && _IsInteger;
+		}
+		
+		// only valid while GetType() == Type::String
+		inline const char* GetStringData() const;
+		inline size_t GetStringLength() const;
+#if __cplusplus >= 201703L
+		std::string_view GetStringView() const
+		{
+			return std::string_view(GetStringData(), GetStringLength());
+		}
+#endif
+		
 		template<typename T>
 		typename AsType<T>::type As();
 		
@@ -306,947 +632,4587 @@ namespace Lua
 		// functions
 		template<typename... Args>
 		ReturnValue operator()(Args&&... args) const;
+		// calls with exactly sizeof...(R) results, converted without going through Variables
+		template<typename... R, typename... Args>
+		typename CallResult<R...>::type Call(Args&&... args) const;
 		
 		// tables
-		inline std::vector<std::pair<Variable, Variable>> pairs();
-		inline std::vector<std::pair<Variable, Variable>> ipairs();
+		inline PairsRange pairs() const;
+		inline IPairsRange ipairs() const;
+		
+		// reads the array part into out, returns how many elements were read
+		template<typename T>
+		size_t CopyTo(Span<T> out) const;
 	};
+	
+	struct Variable::KeyBinding
+	{
+		unsigned Count;
+		Variable Table;
+		Variable Key;
 		
-	class State
+		KeyBinding(const Variable& table, const Variable& key) : Count(1), Table(table), Key(key) {}
+	};
+	
+	// A table lookup that hasn't happened yet: `state["a"]["b"]["c"]` records the path and only walks
+	// it (with a single stack walk, no registry references) when the value is read, assigned or called.
+	// Storing it in a Variable resolves it and keeps the last table/key so the Variable can be assigned to.
+	template<typename Parent, typename Key>
+	class Proxy
 	{
-		lua_State* _State;
 	public:
-		State() : _State(luaL_newstate())
-		{
-		}
-		~State()
-		{
-			lua_close(_State);
-		}
-		operator lua_State* () const
-		{
-			return _State;
-		}
+		State* _State;
+		Parent _Parent;
+		Key    _Key;
 		
-		void LoadStandardLibary()
-		{
-			luaL_openlibs(_State);
-		}
+		Proxy(State* state, const Parent& parent, const Key& key) : _State(state), _Parent(parent), _Key(key) {}
+		Proxy(const Proxy& other) = default;
 		
-		void LoadString(const string& code, const string& name = "LoadString") throw(CompileError)
-		{
-			if(luaL_loadbuffer(_State, code.c_str(), code.length(), name.c_str()))
-			{
-				string err = lua_tostring(_State, -1);
-				lua_pop(_State, 1);
-				throw CompileError(err);
-			}
-		}
+		// walk the path, leaving the value on the stack
+		inline void Push() const;
+		// walk the path, leaving the table the last key indexes on the stack
+		inline void PushTable() const;
 		
-		void DoString(const string& code, const string& name = "DoString") throw(CompileError, RuntimeError)
-		{
-			this->LoadString(code, name);
-			
-			if(lua_pcall(_State, 0, 0, 0))
-			{
-				string err = lua_tostring(_State, -1);
-				lua_pop(_State, 1);
-				throw RuntimeError(err);
-			}
-		}
+		inline Variable Resolve() const; // the value, without remembering where it came from
+		inline operator Variable() const;
 		
-		void LoadFile(const string& file)
-		{
-			if(luaL_loadfile(_State, file.c_str()))
-			{
-				string err = lua_tostring(_State, -1);
-				lua_pop(_State, 1);
-				throw CompileError(err);
-			}
-		}
+		template<typename T>
+		void operator=(const T& val);
+		inline void operator=(const Proxy& other);
 		
-		void DoFile(const string& file)
-		{
-			this->LoadFile(file);
-			
-			if(lua_pcall(_State, 0, 0, 0))
-			{
-				string err = lua_tostring(_State, -1);
-				lua_pop(_State, 1);
-				throw RuntimeError(err);
-			}
-		}
+		template<typename T>
+		Proxy<Proxy, ProxyKey<T>> operator[](const T& key) const;
 		
-		Variable GetRegistry()
-		{
-			lua_pushvalue(*this, LUA_REGISTRYINDEX);
-			
-			Variable _r = Variable::FromStack(this);
-			_r._Registry = true;
-			
-			return _r;
-		}
+		template<typename T>
+		bool operator==(const T& other) const;
+		template<typename T>
+		bool operator!=(const T& other) const;
+		
+		inline Type GetType() const;
+		inline string GetTypeName() const;
+		inline bool IsNil() const;
+		inline string ToString() const;
+		inline string KeyName() const;
 		
-		Variable GetEnviroment()
-		{
-			lua_rawgeti(*this, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-			
-			Variable var = Variable::FromStack(this);
-			var._Global = true;
-			
-			return var;
-		}
-
 		template<typename T>
-		Variable GeneratePointer(std::shared_ptr<T> ptr)
-		{
-			struct Callback
-			{
-				static int garbage(lua_State* lua)
-				{
-					//std::cout << lua_typename(lua, lua_type(lua, -1)) << "\n";
-					
-					lua_getmetatable(lua, -1);
-					lua_pushstring(lua, "__shared_ptr");
-					lua_gettable(lua, -2);
-					
-					std::shared_ptr<T>* ptr = (std::shared_ptr<T>*)lua_touserdata(lua, -1);
-					assert(ptr);
-					assert(*ptr);
-					ptr->~shared_ptr();
-					return 0;
-				}
-			};
-			
-			std::shared_ptr<T>* internal_ptr = (std::shared_ptr<T>*)lua_newuserdata(_State, sizeof(std::shared_ptr<T>));
-			new (internal_ptr) std::shared_ptr<T>(std::move(ptr));
-			
-			Variable userdata = Variable(this);// Use FromStack
-			
-			Variable meta = Variable(this, Type::Table);
-			meta["__gc"] = Variable(this, Callback::garbage);
-			meta["__index"] = this->GetRegistry()[typeid(T).name()];
-			meta["__shared_ptr"] = userdata;
-			meta["__typeid"] = typeid(T).name();
-			
-			Variable obj = Variable(this, Type::Table);
-			obj.SetMetaTable(meta);
-			
-			return obj;
-		}
+		auto As() const -> decltype(Extensions::AllowedType<T>::GetParameter(nullptr, 0));
+		template<typename T>
+		bool Is() const;
 		
-		Variable operator[](const string& key)
-		{
-			return this->GetEnviroment()[key];
-		}
+		template<typename... Args>
+		ReturnValue operator()(Args&&... args) const;
+		// calls with exactly sizeof...(R) results, converted without going through Variables
+		template<typename... R, typename... Args>
+		typename CallResult<R...>::type Call(Args&&... args) const;
+		
+		inline PairsRange pairs() const;
+		inline IPairsRange ipairs() const;
 	};
 	
-	class Reference // to be used with shared_ptr
+	// the root of State::operator[]: the globals table, fetched from its fixed registry slot when
+	// needed rather than held by a Variable
+	class Globals
 	{
-		int _Ref;
-		State* _State;
 	public:
-		Reference(State* state, int ref) : _State(state), _Ref(ref)
-		{
-		}
-		
-		~Reference()
-		{
-			luaL_unref(*_State, LUA_REGISTRYINDEX, _Ref);
-		}
+		State* _State;
 		
-		void Push()
-		{
-			lua_rawgeti(*_State, LUA_REGISTRYINDEX, _Ref);
-		}
+		explicit Globals(State* state) : _State(state) {}
 		
-		static std::shared_ptr<Reference> FromStack(State* state)
+		inline void Push() const;
+		string KeyName() const
 		{
-			return std::make_shared<Reference>(state, luaL_ref(*state, LUA_REGISTRYINDEX));
+			return "the globals table";
 		}
 	};
-
-	class ReturnValue
+	
+	// A non-owning view of a value on the stack, read lazily; the value must stay on the stack while in use.
+	// Unlike Variable nothing is copied or pinned in the registry, call ToVariable() to keep it around.
+	class StackRef
 	{
-	private:
-		State* state;
-		int s;
-
 	public:
-		ReturnValue() : state(nullptr), s(0) {}
-		ReturnValue(State* state, int size) : state(state), s(size) {}
-		~ReturnValue()
+		State* _State;
+		int    _Index;
+		
+		inline StackRef(State* state, int index);
+		
+		inline void Push() const;
+		inline Variable ToVariable() const;
+		
+		inline Type GetType() const;
+		inline string GetTypeName() const;
+		inline bool IsNil() const;
+		inline string ToString() const;
+		inline string KeyName() const;
+		
+		template<typename T>
+		auto As() const -> decltype(Extensions::AllowedType<T>::GetParameter(nullptr, 0));
+		template<typename T>
+		bool Is() const;
+		
+		template<typename T>
+		Proxy<StackRef, ProxyKey<T>> operator[](const T& key) const;
+		
+		template<typename T>
+		bool operator==(const T& other) const;
+		template<typename T>
+		bool operator!=(const T& other) const;
+		
+		template<typename... Args>
+		ReturnValue operator()(Args&&... args) const;
+		// calls with exactly sizeof...(R) results, converted without going through Variables
+		template<typename... R, typename... Args>
+		typename CallResult<R...>::type Call(Args&&... args) const;
+		
+		template<typename T>
+		size_t CopyTo(Span<T> out) const;
+	};
+	
+	// A run of consecutive stack values, such as the arguments of a bound function
+	class StackRange
+	{
+		State* _State;
+		int    _First;
+		int    _Count;
+	public:
+		class iterator
 		{
-			if (s)
-				lua_pop(*state, s);
-		}
-
-		// TODO do we really need these to return ReturnValue from Variable::operator() ?
-		//ReturnValue(const ReturnValue& b) = delete;
-		//ReturnValue(ReturnValue&& b) = delete;
-		ReturnValue& operator=(const ReturnValue& b) = delete;
-
+			State* _State;
+			int    _Index;
+		public:
+			iterator(State* state, int index) : _State(state), _Index(index) {}
+			
+			StackRef operator*() const { return StackRef(_State, _Index); }
+			iterator& operator++() { _Index++; return *this; }
+			bool operator==(const iterator& other) const { return _Index == other._Index; }
+			bool operator!=(const iterator& other) const { return _Index != other._Index; }
+		};
+		
+		inline StackRange(State* state, int first, int count);
+		
+		int Size() const { return _Count; }
+		StackRef operator[](int i) const { return StackRef(_State, _First + i); }
+		iterator begin() const { return iterator(_State, _First); }
+		iterator end() const { return iterator(_State, _First + _Count); }
+	};
+	
+	// Streams a table's pairs with lua_next, the table, key and value stay on the stack while iterating,
+	// so the loop body must leave the stack as it found it. Keys are handed out as a copy, so converting
+	// them (lua_tostring on a number key) can't confuse lua_next.
+	class PairsRange
+	{
+		State* _State;
+		int    _Table;
 	public:
-		int Size()
+		class iterator
+		{
+			State* _State;
+			int    _Table;
+		public:
+			iterator(State* state, int table) : _State(state), _Table(table) {}
+			
+			std::pair<StackRef, StackRef> operator*() const
+			{
+				return std::pair<StackRef, StackRef>(StackRef(_State, _Table + 3), StackRef(_State, _Table + 2));
+			}
+			inline iterator& operator++();
+			bool operator==(const iterator& other) const { return _Table == other._Table; }
+			bool operator!=(const iterator& other) const { return _Table != other._Table; }
+		};
+		
+		inline PairsRange(State* state); // takes the table from the top of the stack
+		inline PairsRange(PairsRange&& other);
+		inline ~PairsRange();
+		PairsRange(const PairsRange&) = delete;
+		
+		inline iterator begin();
+		iterator end() const { return iterator(_State, 0); }
+	};
+	
+	// Streams the array part of a table with lua_rawgeti, up to lua_rawlen or the first nil
+	class IPairsRange
+	{
+		State* _State;
+		int    _Table;
+		lua_Integer _Length;
+	public:
+		class iterator
+		{
+			State* _State;
+			int    _Table;
+			lua_Integer _Index;
+			lua_Integer _Length;
+		public:
+			iterator(State* state, int table, lua_Integer index, lua_Integer length) :
+				_State(state), _Table(table), _Index(index), _Length(length) {}
+			
+			std::pair<lua_Integer, StackRef> operator*() const
+			{
+				return std::pair<lua_Integer, StackRef>(_Index, StackRef(_State, _Table + 1));
+			}
+			inline iterator& operator++();
+			inline void Fetch();
+			bool operator==(const iterator& other) const { return _Index == other._Index; }
+			bool operator!=(const iterator& other) const { return _Index != other._Index; }
+		};
+		
+		inline IPairsRange(State* state); // takes the table from the top of the stack
+		inline IPairsRange(IPairsRange&& other);
+		inline ~IPairsRange();
+		IPairsRange(const IPairsRange&) = delete;
+		
+		lua_Integer Size() const { return _Length; }
+		inline iterator begin();
+		iterator end() const { return iterator(_State, _Table, _Length + 1, _Length); }
+	};
+		
+	// where a State's memory comes from, given to State's constructor and passed to lua_newstate;
+	// it keeps the byte counts and enforces the limit, while the policy deriving from it only has to
+	// provide Reallocate (ptr may be null, then osize is 0; nsize is never 0) and Free.
+	// it must outlive every State made with it, and is not thread safe, so give each State its own
+	class Allocator
+	{
+		size_t _Live;
+		size_t _Peak;
+		size_t _Total;
+		size_t _Limit;
+	public:
+		Allocator() : _Live(0), _Peak(0), _Total(0), _Limit(0)
 		{
-			return s;
 		}
-
-		Variable First()
+		
+		Allocator(const Allocator&) = delete;
+		Allocator& operator=(const Allocator&) = delete;
+		
+		// bytes currently held by Lua
+		size_t GetLiveBytes() const
 		{
-			if (s)
-				return Variable::FromStack(state, -s);
-			else
-				return Variable(state, Type::None);
+			return _Live;
 		}
-
-		std::vector<Variable> ToArray()
+		
+		size_t GetPeakBytes() const
 		{
-			if (!s)
-			{
-				return {};
-			}
-			std::vector<Variable> ret;
-			ret.reserve(s);
-			int index = -s;
-			while (index < 0)
+			return _Peak;
+		}
+		
+		// bytes handed out over the allocator's life, counting only the growth of a reallocation
+		size_t GetTotalBytes() const
+		{
+			return _Total;
+		}
+		
+		size_t GetLimit() const
+		{
+			return _Limit;
+		}
+		
+		// past this many live bytes allocations fail, which Lua raises as a memory error; 0 for no limit.
+		// the error can only be caught inside a protected call (DoString, DoFile, any call through
+		// the wrapper, or the State's own setup); pushing values from C++ outside one while over the
+		// limit panics and aborts, as any unprotected Lua error does
+		void SetLimit(size_t limit)
+		{
+			_Limit = limit;
+		}
+		
+		// the lua_Alloc for policy A, with ud being the A
+		template<typename A>
+		static void* Callback(void* ud, void* ptr, size_t osize, size_t nsize)
+		{
+			A* self = static_cast<A*>(ud);
+			if(!ptr)
+				osize = 0; // osize is the type of the new object instead
+			
+			if(nsize == 0)
 			{
-				ret.push_back(Variable::FromStack(state, index++));
+				if(ptr)
+					self->Free(ptr, osize);
+				self->_Live -= osize;
+				return nullptr;
 			}
+			
+			// shrinking must never fail, Lua does not expect it to
+			if(nsize > osize && self->_Limit != 0 && self->_Live - osize + nsize > self->_Limit)
+				return nullptr;
+			
+			void* ret = self->Reallocate(ptr, osize, nsize);
+			if(!ret)
+				return nullptr;
+			
+			self->_Live = self->_Live - osize + nsize;
+			if(nsize > osize)
+				self->_Total += nsize - osize;
+			if(self->_Live > self->_Peak)
+				self->_Peak = self->_Live;
 			return ret;
 		}
 	};
 	
-	// ---------------------
-	//	 Variable imp
-	// ---------------------
-	namespace _Variable
+	// the C heap, as luaL_newstate uses; for the byte counts and limit alone
+	class MallocAllocator : public Allocator
 	{
-		inline void PushRecursive(State& state, int& argc, Variable& var)
+		friend class Allocator;
+		
+		void* Reallocate(void* ptr, size_t, size_t nsize)
 		{
-			argc++;
-			var.Push();
+			return std::realloc(ptr, nsize);
 		}
 		
-		inline void PushRecursive(State& state, int& argc, std::vector<Variable> vec)
+		void Free(void* ptr, size_t)
 		{
-			for(Variable& var : vec)
-				PushRecursive(state, argc, var);
+			std::free(ptr);
+		}
+	};
+	
+	// small blocks (most strings, tables, closures and upvalues) come from per-size free lists, anything
+	// larger from the C heap. the free lists belong to the thread, so states on one thread reuse each
+	// other's blocks, and the memory behind them is kept for the life of the process
+	class PoolAllocator : public Allocator
+	{
+		friend class Allocator;
+	public:
+		static const size_t Granularity = 16;
+		static const size_t MaxPooled = 256;
+		static const size_t ChunkSize = 64 * 1024;
+	private:
+		static const size_t Classes = MaxPooled / Granularity;
+		
+		struct FreeBlock
+		{
+			FreeBlock* Next;
+		};
+		
+		struct Pools
+		{
+			FreeBlock* Free[Classes];
+			char* Chunk; // carved into new blocks when a free list is empty
+			size_t ChunkLeft;
+		};
+		
+		static Pools& ThreadPools()
+		{
+			static thread_local Pools pools; // zero initialized
+			return pools;
 		}
 		
-		template<typename T>
-		void PushRecursive(State& state, int& argc, T&& arg)
+		// chunks are never given back, but stay reachable after their thread exits
+		static void KeepChunk(char* chunk)
 		{
-			argc++;
-			Extensions::AllowedType<typename std::remove_reference<T>::type>::Push(state, std::forward<T>(arg));
+			static std::mutex lock;
+			static std::vector<char*>* chunks = new std::vector<char*>();
+			std::lock_guard<std::mutex> guard(lock);
+			chunks->push_back(chunk);
 		}
 		
-		inline void PushRecursive(State& state, int& argc)
+		static size_t ClassOf(size_t size)
 		{
-			// finalizer
+			if(size > MaxPooled)
+				return Classes;
+			return size ? (size - 1) / Granularity : 0;
 		}
 		
-		template<typename T, typename... Args>
-		void PushRecursive(State& state, int& argc, T&& arg, Args&&... args)
+		static void* Take(size_t cls)
 		{
-			PushRecursive(state, argc, std::forward<T>(arg));
-			PushRecursive(state, argc, std::forward<Args>(args)...);
+			Pools& pools = ThreadPools();
+			if(FreeBlock* block = pools.Free[cls])
+			{
+				pools.Free[cls] = block->Next;
+				return block;
+			}
+			
+			size_t size = (cls + 1) * Granularity;
+			if(pools.ChunkLeft < size)
+			{
+				char* chunk = static_cast<char*>(std::malloc(ChunkSize));
+				if(!chunk)
+					return nullptr;
+				KeepChunk(chunk);
+				pools.Chunk = chunk;
+				pools.ChunkLeft = ChunkSize;
+			}
+			void* ret = pools.Chunk;
+			pools.Chunk += size;
+			pools.ChunkLeft -= size;
+			return ret;
 		}
 		
-		template<typename... Args>
-		void PushRecursive(State& state, int& argc, Args&&... args)
+		static void Give(void* ptr, size_t cls)
 		{
-			PushRecursive(state, argc, std::forward<Args>(args)...);
+			Pools& pools = ThreadPools();
+			FreeBlock* block = static_cast<FreeBlock*>(ptr);
+			block->Next = pools.Free[cls];
+			pools.Free[cls] = block;
 		}
-	}
+		
+		void* Reallocate(void* ptr, size_t osize, size_t nsize)
+		{
+			size_t to = ClassOf(nsize);
+			if(!ptr)
+				return to < Classes ? Take(to) : std::malloc(nsize);
+			
+			size_t from = ClassOf(osize);
+			if(from == to)
+				return to < Classes ? ptr : std::realloc(ptr, nsize);
+			
+			void* ret = to < Classes ? Take(to) : std::malloc(nsize);
+			if(!ret)
+				return nullptr;
+			std::memcpy(ret, ptr, osize < nsize ? osize : nsize);
+			Free(ptr, osize);
+			return ret;
+		}
+		
+		void Free(void* ptr, size_t osize)
+		{
+			size_t from = ClassOf(osize);
+			if(from < Classes)
+				Give(ptr, from);
+			else
+				std::free(ptr);
+		}
+	};
 	
-	template<typename... Args>
-	ReturnValue Variable::operator()(Args&&... args) const
+	// bumps a pointer through large blocks and frees nothing until it is destroyed, for short lived
+	// states; only the newest allocation is grown, shrunk or freed in place
+	class ArenaAllocator : public Allocator
 	{
-		if(GetType() != Type::Function)
+		friend class Allocator;
+	public:
+		static const size_t Alignment = alignof(std::max_align_t);
+	private:
+		struct Block
 		{
-			throw RuntimeError("Attempted to call " + (_Key != nullptr ? "'"+_Key->ToString()+"'" : "an unindexed variable") + " (a " + GetTypeName() + " value)");
-		}
+			Block* Next;
+		};
 		
-		int top = lua_gettop(*_State);
+		static const size_t HeaderSize = (sizeof(Block) + Alignment - 1) & ~(Alignment - 1);
 		
-		this->Push();
-
-		int argc = 0;
-		_Variable::PushRecursive(*_State, argc, std::forward<Args>(args)...);
+		size_t _BlockSize;
+		Block* _Blocks;
+		char* _Top;
+		char* _End;
+		char* _Last;
 		
-		if (lua_pcall(*_State, argc, LUA_MULTRET, 0))
+		static size_t Align(size_t size)
 		{
-			string err = lua_tostring(*_State, -1);
-			lua_pop(*_State, 1);
+			return (size + Alignment - 1) & ~(Alignment - 1);
+		}
+		
+		void* Bump(size_t size)
+		{
+			size = Align(size);
+			if(static_cast<size_t>(_End - _Top) < size)
+			{
+				size_t bytes = HeaderSize + (size > _BlockSize ? size : _BlockSize);
+				Block* block = static_cast<Block*>(std::malloc(bytes));
+				if(!block)
+					return nullptr;
+				block->Next = _Blocks;
+				_Blocks = block;
+				_Top = reinterpret_cast<char*>(block) + HeaderSize;
+				_End = reinterpret_cast<char*>(block) + bytes;
+			}
+			_Last = _Top;
+			_Top += size;
+			return _Last;
+		}
+		
+		void* Reallocate(void* ptr, size_t osize, size_t nsize)
+		{
+			if(!ptr)
+				return Bump(nsize);
 			
-			throw RuntimeError(err);
+			char* p = static_cast<char*>(ptr);
+			if(p == _Last && Align(nsize) <= static_cast<size_t>(_End - p))
+			{
+				_Top = p + Align(nsize);
+				return ptr;
+			}
+			if(nsize <= osize)
+				return ptr;
+			
+			void* ret = Bump(nsize);
+			if(ret)
+				std::memcpy(ret, ptr, osize);
+			return ret;
 		}
 		
-		int ret = lua_gettop(*_State) - top;
-		if (ret)
-			return ReturnValue(_State, ret);
-		else
-			return ReturnValue();
-	}
-
-	inline Variable::Variable(State* state) :
-		_State(state), _Key(nullptr), _KeyTo(nullptr)
-	{
-	}
+		void Free(void* ptr, size_t)
+		{
+			if(ptr == _Last)
+			{
+				_Top = _Last;
+				_Last = nullptr;
+			}
+		}
+	public:
+		explicit ArenaAllocator(size_t blockSize = 256 * 1024)
+			: _BlockSize(blockSize), _Blocks(nullptr), _Top(nullptr), _End(nullptr), _Last(nullptr)
+		{
+		}
+		
+		~ArenaAllocator()
+		{
+			while(_Blocks)
+			{
+				Block* next = _Blocks->Next;
+				std::free(_Blocks);
+				_Blocks = next;
+			}
+		}
+	};
 	
-	inline void Variable::SetAsStack(int index)
+	// compiled chunks kept on disk for State::LoadFile, so a script is only parsed again once it has changed.
+	// each file has one entry, named after a hash of its chunk name and the Lua version, which begins with
+	// a header holding the source's hash and a hash of the bytecode, since Lua loads bytecode unverified.
+	// a stale or damaged entry is compiled and written over, so a changed file replaces its old entry
+	// rather than adding another. the directory must exist. one cache can be shared by the states of
+	// several threads
+	class BytecodeCache
 	{
-		_Type = static_cast<Type>(lua_type(*_State, -1));
-		_IsReference = false;
-		_Global = false;
-		_Registry = false;
+		struct Header
+		{
+			char Magic[4];
+			uint32_t LuaVersion;
+			uint64_t SourceHash;
+			uint64_t SourceSize;
+			uint64_t BytecodeHash;
+		};
 		
-		switch (_Type)
+		string _Directory;
+		std::atomic<size_t> _Hits;
+		std::atomic<size_t> _Misses;
+		std::atomic<size_t> _Rebuilds;
+		
+		// FNV-1a taken a word at a time, with a fold after each multiply; it runs over every load, so the
+		// bytewise form would cost as much as the undump it saves
+		static uint64_t Hash(const char* data, size_t size, uint64_t hash = 14695981039346656037ull)
 		{
-		case Type::Nil:
-			break;
-		case Type::String:
-			String = lua_tostring(*_State, -1);
-			break;
-		case Type::Number:
-			Data.Real = lua_tonumber(*_State, -1);
-			break;
-		case Type::Boolean:
-			Data.Boolean = lua_toboolean(*_State, -1) != 0;
-			break;
-		case Type::LightUserData:
-			Data.Pointer = lua_touserdata(*_State, -1);
-			break;
-		case Type::Function:
-		case Type::Table:
-		case Type::UserData:
-			lua_pushvalue(*_State, index);
-			Ref = Reference::FromStack(_State);
-			_IsReference = true;
-			break;
-		default:
-			throw RuntimeError("The type `" + GetTypeName() + "' hasn't been implimented!");
+			const uint64_t prime = 0x9E3779B97F4A7C15ull;
+			size_t i = 0;
+			for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+			{
+				uint64_t word;
+				std::memcpy(&word, data + i, sizeof(word));
+				hash = (hash ^ word) * prime;
+				hash ^= hash >> 32;
+			}
+			for(; i < size; i++)
+				hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+			return hash ^ size;
 		}
-	}
-
-	template <typename T>
-	Variable::Variable(State* state, const T& value) : Variable(state)
-	{
-		Extensions::AllowedType<typename std::remove_reference<T>::type>::Push(*state, value);
-		SetAsStack(-1);
-		lua_pop(*state, 1);
-	}
-
-	template <typename Clazz, typename Ret, typename... Args>
-	Variable Variable::FromMemberFunction(State* state, Ret(Clazz::*func)(Args...))
-	{
-		CppFunction::FunctionWrapper<Ret>::template Member<Clazz, Args...>::store(*state, func);
-
-		return Variable::FromStack(state);
-	}
-
-	template <typename Ret, typename... Args>
-	Variable Variable::FromFunction(State* state, Ret(*func)(Args...))
-	{
-		CppFunction::FunctionWrapper<Ret>::template Static<Args...>::store(*state, func);
-
-		return Variable::FromStack(state);
-	}
-
-	inline Variable Variable::FromStack(State* state, int index)
+		
+		// read in chunks rather than sized with tellg, which reports nonsense for a directory
+		static bool ReadFile(const string& path, string& out)
+		{
+			std::ifstream file(path, std::ios::binary);
+			if(!file)
+				return false;
+			
+			char chunk[16 * 1024];
+			out.clear();
+			while(file.read(chunk, sizeof(chunk)) || file.gcount() > 0)
+				out.append(chunk, static_cast<size_t>(file.gcount()));
+			return !file.bad();
+		}
+		
+		static int Writer(lua_State*, const void* data, size_t size, void* ud)
+		{
+			static_cast<string*>(ud)->append(static_cast<const char*>(data), size);
+			return 0;
+		}
+		
+		// the source as luaL_loadfile reads it: without a UTF-8 BOM, and with a first line starting with #
+		// left empty so line numbers still match
+		static void Trim(string& source)
+		{
+			if(source.compare(0, 3, "\xEF\xBB\xBF") == 0)
+				source.erase(0, 3);
+			if(!source.empty() && source[0] == '#')
+				source.erase(0, source.find('\n') == string::npos ? source.size() : source.find('\n'));
+		}
+		
+		string PathFor(uint64_t hash) const
+		{
+			char name[64];
+			std::snprintf(name, sizeof(name), "/%016llx-%d.luac", static_cast<unsigned long long>(hash), LUA_VERSION_NUM);
+			return _Directory + name;
+		}
+		
+		bool LoadEntry(lua_State* L, const string& path, const string& chunkname, uint64_t hash, size_t size)
+		{
+			string entry;
+			if(!ReadFile(path, entry))
+				return false;
+			
+			Header header;
+			bool valid = entry.size() > sizeof(header);
+			if(valid)
+			{
+				std::memcpy(&header, entry.data(), sizeof(header));
+				const char* bytecode = entry.data() + sizeof(header);
+				size_t length = entry.size() - sizeof(header);
+				valid = std::memcmp(header.Magic, "LPPC", 4) == 0 && header.LuaVersion == LUA_VERSION_NUM
+					&& header.SourceHash == hash && header.SourceSize == size && header.BytecodeHash == Hash(bytecode, length);
+				
+				if(valid && luaL_loadbufferx(L, bytecode, length, chunkname.c_str(), "b") == LUA_OK)
+				{
+					_Hits++;
+					return true;
+				}
+				if(valid)
+					lua_pop(L, 1); // rejected by Lua, a different build with the same version
+			}
+			_Rebuilds++;
+			return false;
+		}
+		
+		// written to a temporary first, so a reader never sees half an entry
+		static void WriteEntry(const string& path, const Header& header, const string& bytecode)
+		{
+			static std::atomic<unsigned> counter(0);
+			std::ostringstream tmp;
+			tmp << path << ".tmp" << std::chrono::steady_clock::now().time_since_epoch().count() << "-" << counter++;
+			
+			{
+				std::ofstream file(tmp.str(), std::ios::binary | std::ios::trunc);
+				file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				file.write(bytecode.data(), bytecode.size());
+				if(!file)
+				{
+					file.close();
+					std::remove(tmp.str().c_str());
+					return;
+				}
+			}
+			
+			if(std::rename(tmp.str().c_str(), path.c_str()) != 0)
+			{
+				std::remove(path.c_str()); // rename won't replace an existing file on Windows
+				if(std::rename(tmp.str().c_str(), path.c_str()) != 0)
+					std::remove(tmp.str().c_str());
+			}
+		}
+	public:
+		explicit BytecodeCache(const string& directory) : _Directory(directory), _Hits(0), _Misses(0), _Rebuilds(0)
+		{
+			while(!_Directory.empty() && (_Directory.back() == '/' || _Directory.back() == '\\'))
+				_Directory.pop_back();
+			if(_Directory.empty())
+				_Directory = ".";
+		}
+		
+		BytecodeCache(const BytecodeCache&) = delete;
+		BytecodeCache& operator=(const BytecodeCache&) = delete;
+		
+		// as luaL_loadfile: pushes the compiled chunk or an error message, and returns the status
+		int Load(lua_State* L, const string& file)
+		{
+			string source;
+			if(!ReadFile(file, source))
+				return luaL_loadfile(L, file.c_str()); // for its error message
+			Trim(source);
+			if(source.compare(0, 1, LUA_SIGNATURE, 1) == 0)
+				return luaL_loadfile(L, file.c_str()); // already compiled
+			
+			string chunkname = "@" + file;
+			uint64_t hash = Hash(source.data(), source.size(), Hash(chunkname.c_str(), chunkname.size() + 1));
+			string path = PathFor(Hash(chunkname.c_str(), chunkname.size()));
+			if(LoadEntry(L, path, chunkname, hash, source.size()))
+				return LUA_OK;
+			
+			_Misses++;
+			int status = luaL_loadbufferx(L, source.data(), source.size(), chunkname.c_str(), "t");
+			if(status != LUA_OK)
+				return status;
+			
+			string bytecode;
+#if LUA_VERSION_NUM >= 503
+			lua_dump(L, &Writer, &bytecode, 0);
+#else
+			lua_dump(L, &Writer, &bytecode);
+#endif
+			Header header;
+			std::memcpy(header.Magic, "LPPC", 4);
+			header.LuaVersion = LUA_VERSION_NUM;
+			header.SourceHash = hash;
+			header.SourceSize = source.size();
+			header.BytecodeHash = Hash(bytecode.data(), bytecode.size());
+			WriteEntry(path, header, bytecode);
+			return LUA_OK;
+		}
+		
+		// where file is, or would be, cached
+		string GetEntryPath(const string& file) const
+		{
+			string chunkname = "@" + file;
+			return PathFor(Hash(chunkname.c_str(), chunkname.size()));
+		}
+		
+		const string& GetDirectory() const
+		{
+			return _Directory;
+		}
+		
+		// loads served from the cache
+		size_t GetHits() const
+		{
+			return _Hits.load(std::memory_order_relaxed);
+		}
+		
+		// loads that compiled the source, including rebuilds
+		size_t GetMisses() const
+		{
+			return _Misses.load(std::memory_order_relaxed);
+		}
+		
+		// entries found stale or damaged and written again
+		size_t GetRebuilds() const
+		{
+			return _Rebuilds.load(std::memory_order_relaxed);
+		}
+	};
+	
+	class State
 	{
-		Variable ret(state);
-		ret.SetAsStack(index);
-		return ret;
-	}
+		lua_State* _State;
+		
+		// every Reference owns one registry slot for its whole life, reserved up front with luaL_ref,
+		// so handing references out and back never touches the registry's own free list
+		std::vector<Reference*> _References;
+		std::vector<Reference*> _FreeReferences;
+		std::vector<Reference*> _ReleasedReferences; // free, but the slot still holds its old value
+		size_t _LiveReferences;
+		size_t _PeakReferences;
+		unsigned _CallDepth; // calls into Lua made through Call(), which defer clearing released slots
+		
+		BytecodeCache* _Cache;
+		
+		Reference* _GlobalsRef;  // held for the State's life, so GetEnviroment() and GetRegistry()
+		Reference* _RegistryRef; // hand out Variables without taking a new slot each time
+		
+		inline void ReserveReferences(size_t count);
+		
+		static const void* StateKey()
+		{
+			static const char key = 0;
+			return &key;
+		}
+	public:
+		// how many slots are reserved at a time, and how many released slots are cleared at once while
+		// Lua is running; outside a call a released slot is cleared straight away
+		static const size_t ReferenceBatch = 64;
+	private:
+		// the body is out of line, as it deletes References
+		inline explicit State(lua_State* L);
+		static inline int Setup(lua_State* L);
+		
+		static int Panic(lua_State* L)
+		{
+			const char* msg = lua_tostring(L, -1);
+			std::fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", msg ? msg : "error object is not a string");
+			return 0;
+		}
+	public:
+		State() : State(luaL_newstate())
+		{
+		}
+		
+		// allocates through the policy, which must outlive the State
+		template<typename A, typename = typename std::enable_if<std::is_base_of<Allocator, A>::value>::type>
+		explicit State(A& allocator) : State(lua_newstate(&Allocator::Callback<A>, &allocator))
+		{
+			lua_atpanic(_State, &Panic);
+		}
+		
+		inline ~State();
+		
+		State(const State&) = delete;
+		State& operator=(const State&) = delete;
+		
+		operator lua_State* () const
+		{
+			return _State;
+		}
+		
+		// the State that owns L, for code that only has the lua_State (such as bound functions)
+		static State* FromLuaState(lua_State* L)
+		{
+#if LUA_VERSION_NUM >= 503
+			return *static_cast<State**>(lua_getextraspace(L));
+#else
+			lua_rawgetp(L, LUA_REGISTRYINDEX, StateKey());
+			State* state = static_cast<State*>(lua_touserdata(L, -1));
+			lua_pop(L, 1);
+			return state;
+#endif
+		}
+		
+		void LoadStandardLibary()
+		{
+			luaL_openlibs(_State);
+		}
+		
+		void LoadString(const string& code, const string& name = "LoadString")
+		{
+			if(luaL_loadbuffer(_State, code.c_str(), code.length(), name.c_str()))
+			{
+				string err = lua_tostring(_State, -1);
+				lua_pop(_State, 1);
+				throw CompileError(err);
+			}
+		}
+		
+		void DoString(const string& code, const string& name = "DoString")
+		{
+			this->LoadString(code, name);
+			
+			if(PCall(0, 0))
+			{
+				string err = lua_tostring(_State, -1);
+				lua_pop(_State, 1);
+				throw RuntimeError(err);
+			}
+		}
+		
+		// compiles files through the cache from now on, or directly again if null; it must outlive the State
+		void SetBytecodeCache(BytecodeCache* cache)
+		{
+			_Cache = cache;
+		}
+		
+		BytecodeCache* GetBytecodeCache() const
+		{
+			return _Cache;
+		}
+		
+		void LoadFile(const string& file)
+		{
+			if(_Cache ? _Cache->Load(_State, file) : luaL_loadfile(_State, file.c_str()))
+			{
+				string err = lua_tostring(_State, -1);
+				lua_pop(_State, 1);
+				throw CompileError(err);
+			}
+		}
+		
+		void DoFile(const string& file)
+		{
+			this->LoadFile(file);
+			
+			if(PCall(0, 0))
+			{
+				string err = lua_tostring(_State, -1);
+				lua_pop(_State, 1);
+				throw RuntimeError(err);
+			}
+		}
+		
+		inline Variable GetRegistry();
+		inline Variable GetEnviroment();
 
-	inline Variable Variable::FromStack(State* state)
-	{
-		Variable ret = FromStack(state, -1);
-		lua_pop(*state, 1);
-		return ret;
-	}
+		// one userdata holding the shared_ptr, with methods looked up in GetMethods<T>()
+		template<typename T>
+		Variable GeneratePointer(std::shared_ptr<T> ptr)
+		{
+			return Variable(this, ptr);
+		}
+		
+		// the methods of every T pushed to Lua, by value or through a shared_ptr
+		template<typename T>
+		inline Variable GetMethods();
+		
+		// fills in GetMethods<T>(), which is also set as the global name if one is given
+		template<typename T>
+		inline ClassBuilder<T> RegisterClass(const string& name = "");
+		
+		// a global, read and written straight off the globals table
+		Proxy<Globals, string> operator[](const string& key)
+		{
+			return Proxy<Globals, string>(this, Globals(this), key);
+		}
+		
+		// pops the top of the stack into a pooled registry slot
+		inline Reference* CreateReference();
+		inline void ReleaseReference(Reference* ref);
+		// clears the slots of released references so their values can be collected
+		inline void CollectReferences();
+		
+		// lua_pcall, with references released during it cleared once the outermost call returns
+		int PCall(int nargs, int nresults, int handler = 0)
+		{
+			_CallDepth++;
+			int status = lua_pcall(_State, nargs, nresults, handler);
+			if(--_CallDepth == 0)
+				CollectReferences();
+			return status;
+		}
+		
+		size_t GetLiveReferences() const
+		{
+			return _LiveReferences;
+		}
+		
+		size_t GetPeakReferences() const
+		{
+			return _PeakReferences;
+		}
+	};
 	
-	inline Variable::Variable(State* state, Type type) : Variable(state)
+	class Reference // intrusively counted by the Variables holding it, see Variable::CopyValue()
 	{
-		_Type = type;
-		_IsReference = false;
-		_Global = false;
-		_Registry = false;
+		friend class State;
 		
-		Ref = nullptr;
-		Data.Integer = 0;
-		String = "";
+		State* _State;
+		int _Ref;
+		unsigned _Count;
+	public:
+		Reference(State* state, int ref) : _State(state), _Ref(ref), _Count(0)
+		{
+		}
 		
-		switch(type)
+		Reference(const Reference&) = delete;
+		Reference& operator=(const Reference&) = delete;
+		
+		void Push()
 		{
-		case Type::Function:
-		case Type::LightUserData:
-		case Type::UserData:
-			_IsReference = true;
-			break;
-		case Type::Table:
-			lua_newtable(*_State);
-			Ref = Reference::FromStack(_State);
-			_IsReference = true;
-			break;
+			lua_rawgeti(*_State, LUA_REGISTRYINDEX, _Ref);
+		}
+		
+		void Retain()
+		{
+			_Count++;
+		}
+		
+		void Release()
+		{
+			if(--_Count == 0)
+				_State->ReleaseReference(this);
+		}
+		
+		static Reference* FromStack(State* state)
+		{
+			return state->CreateReference();
+		}
+	};
+	
+	// ---------------------
+	//	 State imp
+	// ---------------------
+	inline State::State(lua_State* L) : _State(L), _LiveReferences(0), _PeakReferences(0), _CallDepth(0), _Cache(nullptr)
+	{
+		if(!_State)
+			throw RuntimeError("not enough memory");
+		
+		// protected, so an allocator limit too low for the setup is an error rather than a panic
+		lua_pushcfunction(_State, &CppFunction::Protected<&Setup>);
+		lua_pushlightuserdata(_State, this);
+		if(lua_pcall(_State, 1, 0, 0))
+		{
+			const char* msg = lua_tostring(_State, -1);
+			string err = msg ? msg : "not enough memory";
+			lua_close(_State);
+			for(Reference* ref : _References)
+				delete ref;
+			throw RuntimeError(err);
 		}
 	}
 	
-	inline Variable::~Variable()
+	inline int State::Setup(lua_State* L)
 	{
+		State* state = static_cast<State*>(lua_touserdata(L, 1));
+		lua_pop(L, 1);
+#if LUA_VERSION_NUM >= 503
+		*static_cast<State**>(lua_getextraspace(L)) = state;
+#else
+		lua_pushlightuserdata(L, state);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, StateKey());
+#endif
+		state->ReserveReferences(ReferenceBatch);
+		
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		state->_GlobalsRef = state->CreateReference();
+		lua_pushvalue(L, LUA_REGISTRYINDEX);
+		state->_RegistryRef = state->CreateReference();
+		return 0;
 	}
 	
-	inline void Variable::SetKey(std::shared_ptr<Variable> key, Variable* to)
+	inline State::~State()
 	{
-		_Key = nullptr;
-		_Key = key;
+		lua_close(_State);
 		
-		_KeyTo = to->Ref;
+		for(Reference* ref : _References)
+			delete ref;
 	}
 	
-	inline string Variable::ToString() const
+	inline void State::ReserveReferences(size_t count)
 	{
-		std::stringstream ss;
+		_References.reserve(_References.size() + count);
+		_FreeReferences.reserve(_FreeReferences.size() + count);
 		
-		switch(_Type)
+		for(size_t i = 0; i < count; i++)
 		{
-		case Type::Nil:
-			return "nil";
-		case Type::String:
-			ss << "\"" << String << "\"";
-			return ss.str();
-		case Type::Number:
-			ss << Data.Real;
-			return ss.str();
-		case Type::Boolean:
-			return Data.Boolean ? "true" : "false";
-		case Type::Function:
-			return "[function]";
-		case Type::Table:
-			return "[table]";
-		case Type::UserData:
-			return "[userdata]";
-		case Type::LightUserData:
-			return "[lightuserdata]";
-		default:
-			return "ukn";
+			// a placeholder rather than nil, so luaL_ref never sees a hole it could hand out again
+			lua_pushboolean(_State, 0);
+			int slot = luaL_ref(_State, LUA_REGISTRYINDEX); // may raise, so before anything is owned
+			Reference* ref = new Reference(this, slot);
+			
+			_References.push_back(ref);
+			_FreeReferences.push_back(ref);
 		}
 	}
 	
-	inline Variable Variable::MetaTable() const
+	inline Reference* State::CreateReference()
 	{
-		this->Push();
+		Reference* ref;
 		
-		if(!lua_getmetatable(*_State, -1))
-			return Variable(_State, Type::Nil);
+		if(!_ReleasedReferences.empty())
+		{
+			// the old value is overwritten below, no need to clear it first
+			ref = _ReleasedReferences.back();
+			_ReleasedReferences.pop_back();
+		}
+		else
+		{
+			if(_FreeReferences.empty())
+				ReserveReferences(_References.size() > ReferenceBatch ? _References.size() : ReferenceBatch);
+			
+			ref = _FreeReferences.back();
+			_FreeReferences.pop_back();
+		}
 		
-		Variable ret = Variable::FromStack(_State);
-		assert(ret.GetType() == Type::Table);
-		return ret;
+		lua_rawseti(_State, LUA_REGISTRYINDEX, ref->_Ref);
+		ref->_Count = 1;
+		
+		_LiveReferences++;
+		_PeakReferences = std::max(_PeakReferences, _LiveReferences);
+		return ref;
 	}
 	
-	inline Variable Variable::SetMetaTable(const Variable& tbl)
+	inline void State::ReleaseReference(Reference* ref)
 	{
-		if(tbl.GetType() != Type::Table)
-			throw RuntimeError("SetMetaTable(): argument is not a table!");
+		assert(ref->_Count == 0);
+		
+		_LiveReferences--;
+		if(_CallDepth == 0)
+		{
+			lua_pushboolean(_State, 0);
+			lua_rawseti(_State, LUA_REGISTRYINDEX, ref->_Ref);
+			_FreeReferences.push_back(ref);
+			return;
+		}
+		_ReleasedReferences.push_back(ref);
+		
+		if(_ReleasedReferences.size() >= ReferenceBatch)
+			CollectReferences();
+	}
+	
+	inline void State::CollectReferences()
+	{
+		for(Reference* ref : _ReleasedReferences)
+		{
+			lua_pushboolean(_State, 0);
+			lua_rawseti(_State, LUA_REGISTRYINDEX, ref->_Ref);
+			_FreeReferences.push_back(ref);
+		}
+		_ReleasedReferences.clear();
+	}
+	
+	inline void Globals::Push() const
+	{
+		lua_rawgeti(*_State, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	}
+
+	class ReturnValue
+	{
+	private:
+		State* state;
+		int s;
+
+	public:
+		ReturnValue() : state(nullptr), s(0) {}
+		ReturnValue(State* state, int size) : state(state), s(size) {}
+		~ReturnValue()
+		{
+			if (s)
+				lua_pop(*state, s);
+		}
+
+		// TODO do we really need these to return ReturnValue from Variable::operator() ?
+		//ReturnValue(const ReturnValue& b) = delete;
+		//ReturnValue(ReturnValue&& b) = delete;
+		ReturnValue& operator=(const ReturnValue& b) = delete;
+
+	public:
+		int Size()
+		{
+			return s;
+		}
+
+		Variable First()
+		{
+			if (s)
+				return Variable::FromStack(state, -s);
+			else
+				return Variable(state, Type::None);
+		}
+
+		std::vector<Variable> ToArray()
+		{
+			if (!s)
+			{
+				return {};
+			}
+			std::vector<Variable> ret;
+			ret.reserve(s);
+			int index = -s;
+			while (index < 0)
+			{
+				ret.push_back(Variable::FromStack(state, index++));
+			}
+			return ret;
+		}
+	};
+	
+	// ---------------------
+	//	 Variable imp
+	// ---------------------
+	namespace _Variable
+	{
+		inline void PushValue(State& state, const Variable& var)
+		{
+			var.Push();
+		}
+		
+		inline void PushValue(State& state, const LuaTable& t)
+		{
+			lua_newtable(state);
+		}
+		
+		template<typename Parent, typename Key>
+		void PushValue(State& state, const Proxy<Parent, Key>& proxy)
+		{
+			proxy.Push();
+		}
+		
+		inline void PushValue(State& state, const StackRef& ref)
+		{
+			ref.Push();
+		}
+		
+		template<typename T>
+		void PushValue(State& state, const T& value)
+		{
+			Extensions::AllowedType<T>::Push(state, value);
+		}
+		
+		inline void PushRecursive(State& state, int& argc, std::vector<Variable> vec)
+		{
+			for(Variable& var : vec)
+			{
+				argc++;
+				var.Push();
+			}
+		}
+		
+		template<typename T>
+		void PushRecursive(State& state, int& argc, T&& arg)
+		{
+			argc++;
+			PushValue(state, arg);
+		}
+		
+		inline void PushRecursive(State& state, int& argc)
+		{
+			// finalizer
+		}
+		
+		template<typename T, typename... Args>
+		void PushRecursive(State& state, int& argc, T&& arg, Args&&... args)
+		{
+			PushRecursive(state, argc, std::forward<T>(arg));
+			PushRecursive(state, argc, std::forward<Args>(args)...);
+		}
+		
+		template<typename... Args>
+		void PushRecursive(State& state, int& argc, Args&&... args)
+		{
+			PushRecursive(state, argc, std::forward<Args>(args)...);
+		}
+		
+		// calls the function on the top of the stack
+		template<typename... Args>
+		ReturnValue Call(State* state, Args&&... args)
+		{
+			int top = lua_gettop(*state) - 1;
+			
+			int argc = 0;
+			PushRecursive(*state, argc, std::forward<Args>(args)...);
+			
+			if (state->PCall(argc, LUA_MULTRET))
+			{
+				string err = lua_tostring(*state, -1);
+				lua_pop(*state, 1);
+				
+				throw RuntimeError(err);
+			}
+			
+			int ret = lua_gettop(*state) - top;
+			if (ret)
+				return ReturnValue(state, ret);
+			else
+				return ReturnValue();
+		}
+		
+		// pops the results of a typed call once they've been converted, or failed to
+		struct ResultGuard
+		{
+			lua_State* L;
+			int Count;
+			~ResultGuard()
+			{
+				lua_pop(L, Count);
+			}
+		};
+		
+		// calls the function on the top of the stack, asking for exactly as many results as R has
+		template<typename... R, typename... Args>
+		typename CallResult<R...>::type TypedCall(State* state, Args&&... args)
+		{
+			int argc = 0;
+			PushRecursive(*state, argc, std::forward<Args>(args)...);
+			
+			const int results = CallResult<R...>::Count;
+			if (state->PCall(argc, results))
+			{
+				string err = lua_tostring(*state, -1);
+				lua_pop(*state, 1);
+				
+				throw RuntimeError(err);
+			}
+			
+			ResultGuard guard = { *state, results };
+			return CallResult<R...>::Read(*state, lua_gettop(*state) - results + 1);
+		}
+	}
+	
+	template<typename... Args>
+	ReturnValue Variable::operator()(Args&&... args) const
+	{
+		if(GetType() != Type::Function)
+		{
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
 		
 		this->Push();
-		tbl.Push();
+		return _Variable::Call(_State, std::forward<Args>(args)...);
+	}
+	
+	template<typename... R, typename... Args>
+	typename CallResult<R...>::type Variable::Call(Args&&... args) const
+	{
+		if(GetType() != Type::Function)
+		{
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
 		
-		lua_setmetatable(*_State, -2);
+		this->Push();
+		return _Variable::TypedCall<R...>(_State, std::forward<Args>(args)...);
+	}
+
+	// ---------------------
+	//	 FunctionHandle
+	// ---------------------
+	namespace _Variable
+	{
+		// the results a FunctionHandle<R(Args...)> reads, a std::tuple return is spread over several
+		template<typename R>
+		struct FunctionResult
+		{
+			typedef CallResult<R> type;
+		};
+		template<>
+		struct FunctionResult<void>
+		{
+			typedef CallResult<> type;
+		};
+		template<typename... R>
+		struct FunctionResult<std::tuple<R...>>
+		{
+			typedef CallResult<R...> type;
+		};
+	}
+	
+	template<typename Signature>
+	class FunctionHandle;
+	
+	// a Lua function resolved once and held in a fixed registry slot, for entry points that are called over
+	// and over: a call is one lua_rawgeti, the typed argument pushes and one lua_pcall with the optional
+	// message handler. R may be void, a value, or a std::tuple of several results
+	template<typename R, typename... Args>
+	class FunctionHandle<R(Args...)>
+	{
+		typedef typename _Variable::FunctionResult<R>::type Results;
 		
-		return Variable::FromStack(_State);
+		State* _State;
+		Reference* _Function;
+		Reference* _Handler;
+		
+		static Reference* Bind(const Variable& func)
+		{
+			if(func.GetType() != Type::Function || !func.Data.Ref)
+				throw RuntimeError("Can not bind a " + func.GetTypeName() + " value to a FunctionHandle");
+			
+			func.Data.Ref->Retain();
+			return func.Data.Ref;
+		}
+	public:
+		FunctionHandle() : _State(nullptr), _Function(nullptr), _Handler(nullptr) {}
+		FunctionHandle(const Variable& func) : _State(func._State), _Function(Bind(func)), _Handler(nullptr) {}
+		FunctionHandle(const Variable& func, const Variable& handler) : _State(func._State), _Function(Bind(func)), _Handler(Bind(handler)) {}
+		template<typename Parent, typename Key>
+		FunctionHandle(const Proxy<Parent, Key>& func) : FunctionHandle(func.Resolve()) {}
+		
+		FunctionHandle(const FunctionHandle& other) : _State(other._State), _Function(other._Function), _Handler(other._Handler)
+		{
+			if(_Function)
+				_Function->Retain();
+			if(_Handler)
+				_Handler->Retain();
+		}
+		FunctionHandle(FunctionHandle&& other) : _State(other._State), _Function(other._Function), _Handler(other._Handler)
+		{
+			other._Function = nullptr;
+			other._Handler = nullptr;
+		}
+		~FunctionHandle()
+		{
+			if(_Function)
+				_Function->Release();
+			if(_Handler)
+				_Handler->Release();
+		}
+		
+		FunctionHandle& operator=(FunctionHandle other)
+		{
+			std::swap(_State, other._State);
+			std::swap(_Function, other._Function);
+			std::swap(_Handler, other._Handler);
+			return *this;
+		}
+		
+		// called with the error object when a call fails, debug.traceback for example
+		void SetMessageHandler(const Variable& handler)
+		{
+			Reference* ref = Bind(handler);
+			if(_Handler)
+				_Handler->Release();
+			_Handler = ref;
+		}
+		
+		explicit operator bool() const
+		{
+			return _Function != nullptr;
+		}
+		
+		R operator()(Args... args) const
+		{
+			if(!_Function)
+				throw RuntimeError("Attempted to call an unbound FunctionHandle");
+			
+			lua_State* L = *_State;
+			int handler = 0;
+			if(_Handler)
+			{
+				_Handler->Push();
+				handler = lua_gettop(L);
+			}
+			
+			_Function->Push();
+			int pushed[] = { 0, (_Variable::PushValue(*_State, args), 0)... };
+			(void)pushed;
+			
+			if(_State->PCall(sizeof...(Args), Results::Count, handler))
+			{
+				const char* msg = lua_tostring(L, -1);
+				string err = msg ? msg : string("(error object is a ") + luaL_typename(L, -1) + " value)";
+				lua_pop(L, handler ? 2 : 1);
+				
+				throw RuntimeError(err);
+			}
+			
+			if(handler)
+				lua_remove(L, handler);
+			
+			_Variable::ResultGuard guard = { L, Results::Count };
+			return Results::Read(L, lua_gettop(L) - Results::Count + 1);
+		}
+	};
+	
+	// a global that C++ reads or writes often, such as every frame; its name is pinned as a Lua string
+	// once, so an access is two lua_rawgetis and one lookup, without hashing the name or making a Variable
+	template<typename T>
+	class Global
+	{
+		typedef Extensions::AllowedType<typename std::decay<T>::type> Converter;
+		typedef decltype(Converter::GetParameter(nullptr, 0)) Result;
+		
+		State* _State;
+		Reference* _Name;
+	public:
+		Global(State* state, const string& name) : _State(state)
+		{
+			lua_pushlstring(*state, name.data(), name.length());
+			_Name = state->CreateReference();
+		}
+		
+		Global(const Global& other) : _State(other._State), _Name(other._Name)
+		{
+			_Name->Retain();
+		}
+		Global& operator=(const Global&) = delete;
+		~Global()
+		{
+			_Name->Release();
+		}
+		
+		Result Get() const
+		{
+			lua_State* L = *_State;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			_Name->Push();
+			lua_gettable(L, -2);
+			
+			_Variable::ResultGuard guard = { L, 2 };
+			return Converter::GetParameter(L, -1);
+		}
+		operator Result() const
+		{
+			return Get();
+		}
+		
+		void Set(const T& value)
+		{
+			lua_State* L = *_State;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			_Name->Push();
+			_Variable::PushValue(*_State, value);
+			lua_settable(L, -3);
+			lua_pop(L, 1);
+		}
+		Global& operator=(const T& value)
+		{
+			Set(value);
+			return *this;
+		}
+		
+		bool IsNil() const
+		{
+			lua_State* L = *_State;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			_Name->Push();
+			lua_gettable(L, -2);
+			bool ret = lua_isnil(L, -1);
+			lua_pop(L, 2);
+			return ret;
+		}
+	};
+	
+	// ---------------------
+	//	 StackRef imp
+	// ---------------------
+	inline StackRef::StackRef(State* state, int index) :
+		_State(state), _Index(lua_absindex(*state, index))
+	{
+	}
+	
+	inline void StackRef::Push() const
+	{
+		lua_pushvalue(*_State, _Index);
+	}
+	
+	inline Variable StackRef::ToVariable() const
+	{
+		return Variable::FromStack(_State, _Index);
+	}
+	
+	inline Type StackRef::GetType() const
+	{
+		return static_cast<Type>(lua_type(*_State, _Index));
+	}
+	
+	inline string StackRef::GetTypeName() const
+	{
+		return lua_typename(*_State, GetType());
+	}
+	
+	inline bool StackRef::IsNil() const
+	{
+		return lua_isnoneornil(*_State, _Index);
+	}
+	
+	inline string StackRef::ToString() const
+	{
+		return ToVariable().ToString();
+	}
+	
+	inline string StackRef::KeyName() const
+	{
+		std::stringstream ss;
+		ss << "stack value #" << _Index;
+		return ss.str();
+	}
+	
+	template<typename T>
+	auto StackRef::As() const -> decltype(Extensions::AllowedType<T>::GetParameter(nullptr, 0))
+	{
+		return Extensions::AllowedType<T>::GetParameter(*_State, _Index);
+	}
+	
+	template<typename T>
+	bool StackRef::Is() const
+	{
+		return Extensions::AllowedType<T>::CheckParameter(*_State, _Index);
+	}
+	
+	template<typename T>
+	Proxy<StackRef, ProxyKey<T>> StackRef::operator[](const T& key) const
+	{
+		return Proxy<StackRef, ProxyKey<T>>(_State, *this, key);
+	}
+	
+	template<typename T>
+	bool StackRef::operator==(const T& other) const
+	{
+		_Variable::PushValue(*_State, other);
+		bool ret = lua_compare(*_State, _Index, -1, LUA_OPEQ) == 1;
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	template<typename T>
+	bool StackRef::operator!=(const T& other) const
+	{
+		return !operator==(other);
+	}
+	
+	template<typename... Args>
+	ReturnValue StackRef::operator()(Args&&... args) const
+	{
+		if(GetType() != Type::Function)
+		{
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
+		
+		this->Push();
+		return _Variable::Call(_State, std::forward<Args>(args)...);
+	}
+	
+	template<typename... R, typename... Args>
+	typename CallResult<R...>::type StackRef::Call(Args&&... args) const
+	{
+		if(GetType() != Type::Function)
+		{
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
+		
+		this->Push();
+		return _Variable::TypedCall<R...>(_State, std::forward<Args>(args)...);
+	}
+	
+	template<typename T>
+	size_t StackRef::CopyTo(Span<T> out) const
+	{
+		return Extensions::AllowedType<Span<T>>::Read(*_State, _Index, out);
+	}
+	
+	inline StackRange::StackRange(State* state, int first, int count) :
+		_State(state), _First(lua_absindex(*state, first)), _Count(count)
+	{
+	}
+	
+	// ---------------------
+	//	 PairsRange imp
+	// ---------------------
+	inline PairsRange::PairsRange(State* state) :
+		_State(state), _Table(lua_gettop(*state))
+	{
+	}
+	
+	inline PairsRange::PairsRange(PairsRange&& other) :
+		_State(other._State), _Table(other._Table)
+	{
+		other._State = nullptr;
+	}
+	
+	inline PairsRange::~PairsRange()
+	{
+		if(_State)
+			lua_settop(*_State, _Table - 1);
+	}
+	
+	inline PairsRange::iterator PairsRange::begin()
+	{
+		lua_settop(*_State, _Table);
+		lua_pushnil(*_State);
+		iterator ret(_State, _Table);
+		return ++ret;
+	}
+	
+	inline PairsRange::iterator& PairsRange::iterator::operator++()
+	{
+		/* tbl, key, [value, key copy] */
+		lua_settop(*_State, _Table + 1);
+		if(lua_next(*_State, _Table))
+			lua_pushvalue(*_State, -2);
+		else
+			_Table = 0; // lua_next popped the key, we're at the end
+		return *this;
+	}
+	
+	inline IPairsRange::IPairsRange(State* state) :
+		_State(state), _Table(lua_gettop(*state)), _Length(lua_rawlen(*state, -1))
+	{
+	}
+	
+	inline IPairsRange::IPairsRange(IPairsRange&& other) :
+		_State(other._State), _Table(other._Table), _Length(other._Length)
+	{
+		other._State = nullptr;
+	}
+	
+	inline IPairsRange::~IPairsRange()
+	{
+		if(_State)
+			lua_settop(*_State, _Table - 1);
+	}
+	
+	inline IPairsRange::iterator IPairsRange::begin()
+	{
+		iterator ret(_State, _Table, 1, _Length);
+		ret.Fetch();
+		return ret;
+	}
+	
+	inline void IPairsRange::iterator::Fetch()
+	{
+		/* tbl, [value] */
+		lua_settop(*_State, _Table);
+		if(_Index > _Length)
+			return;
+		
+		lua_rawgeti(*_State, _Table, _Index);
+		if(lua_isnil(*_State, -1))
+			_Index = _Length + 1;
+	}
+	
+	inline IPairsRange::iterator& IPairsRange::iterator::operator++()
+	{
+		_Index++;
+		Fetch();
+		return *this;
+	}
+	
+	// ---------------------
+	//	 Proxy imp
+	// ---------------------
+	namespace _Variable
+	{
+		// proxies with a string key straight off the globals skip pushing the globals table through Globals::Push;
+		// std::string keys may hold embedded NULs, so they are pushed with their length rather than as a C string
+		template<typename Parent, typename Key>
+		struct GlobalKey
+		{
+			static const bool value = false;
+			static void Get(lua_State* L, const Key& key) {}
+			static void Set(lua_State* L, const Key& key) {}
+		};
+		template<>
+		struct GlobalKey<Globals, string>
+		{
+			static const bool value = true;
+			static void Get(lua_State* L, const string& key)
+			{
+				lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+				lua_pushlstring(L, key.data(), key.size());
+				lua_gettable(L, -2);
+				lua_remove(L, -2);
+			}
+			// expects the value on top of the stack, and pops it
+			static void Set(lua_State* L, const string& key)
+			{
+				lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+				lua_insert(L, -2);
+				lua_pushlstring(L, key.data(), key.size());
+				lua_insert(L, -2);
+				lua_settable(L, -3);
+				lua_pop(L, 1);
+			}
+		};
+		template<>
+		struct GlobalKey<Globals, const char*>
+		{
+			static const bool value = true;
+			static void Get(lua_State* L, const char* key) { lua_getglobal(L, key); }
+			static void Set(lua_State* L, const char* key) { lua_setglobal(L, key); }
+		};
+	}
+	
+	template<typename Parent, typename Key>
+	void Proxy<Parent, Key>::PushTable() const
+	{
+		_Parent.Push();
+		
+		int type = lua_type(*_State, -1);
+		if(type == LUA_TUSERDATA && luaL_getmetafield(*_State, -1, "__index")) // indexable userdata, such as a Buffer
+		{
+			lua_pop(*_State, 1);
+			return;
+		}
+		if(type != LUA_TTABLE)
+		{
+			lua_pop(*_State, 1);
+			throw RuntimeError("Attempted to index " + _Parent.KeyName() + " (a " + lua_typename(*_State, type) + " value)");
+		}
+	}
+	
+	template<typename Parent, typename Key>
+	void Proxy<Parent, Key>::Push() const
+	{
+		typedef _Variable::GlobalKey<Parent, Key> Global;
+		if(Global::value)
+		{
+			Global::Get(*_State, _Key);
+			return;
+		}
+		
+		PushTable();
+		_Variable::PushValue(*_State, _Key);
+		lua_gettable(*_State, -2);
+		lua_remove(*_State, -2);
+	}
+	
+	template<typename Parent, typename Key>
+	Variable Proxy<Parent, Key>::Resolve() const
+	{
+		Push();
+		return Variable::FromStack(_State);
+	}
+	
+	template<typename Parent, typename Key>
+	Proxy<Parent, Key>::operator Variable() const
+	{
+		PushTable();
+		Variable table = Variable::FromStack(_State, -1);
+		
+		_Variable::PushValue(*_State, _Key);
+		Variable key = Variable::FromStack(_State, -1);
+		
+		lua_gettable(*_State, -2);
+		Variable ret = Variable::FromStack(_State);
+		ret.SetKey(key, table);
+		
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	void Proxy<Parent, Key>::operator=(const T& val)
+	{
+		typedef _Variable::GlobalKey<Parent, Key> Global;
+		if(Global::value)
+		{
+			_Variable::PushValue(*_State, val);
+			Global::Set(*_State, _Key);
+			return;
+		}
+		
+		PushTable();
+		_Variable::PushValue(*_State, _Key);
+		_Variable::PushValue(*_State, val);
+		
+		lua_settable(*_State, -3);
+		lua_pop(*_State, 1);
+	}
+	
+	template<typename Parent, typename Key>
+	void Proxy<Parent, Key>::operator=(const Proxy& other)
+	{
+		this->operator=<Proxy>(other);
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	Proxy<Proxy<Parent, Key>, ProxyKey<T>> Proxy<Parent, Key>::operator[](const T& key) const
+	{
+		return Proxy<Proxy, ProxyKey<T>>(_State, *this, key);
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	bool Proxy<Parent, Key>::operator==(const T& other) const
+	{
+		this->Push();
+		try
+		{
+			_Variable::PushValue(*_State, other);
+		}
+		catch(...)
+		{
+			lua_pop(*_State, 1);
+			throw;
+		}
+		bool ret = lua_compare(*_State, -2, -1, LUA_OPEQ) == 1;
+		lua_pop(*_State, 2);
+		return ret;
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	bool Proxy<Parent, Key>::operator!=(const T& other) const
+	{
+		return !operator==(other);
+	}
+	
+	template<typename Parent, typename Key>
+	Type Proxy<Parent, Key>::GetType() const
+	{
+		Push();
+		Type ret = static_cast<Type>(lua_type(*_State, -1));
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	template<typename Parent, typename Key>
+	string Proxy<Parent, Key>::GetTypeName() const
+	{
+		return lua_typename(*_State, GetType());
+	}
+	
+	template<typename Parent, typename Key>
+	bool Proxy<Parent, Key>::IsNil() const
+	{
+		return GetType() == Type::Nil;
+	}
+	
+	template<typename Parent, typename Key>
+	string Proxy<Parent, Key>::ToString() const
+	{
+		return Resolve().ToString();
+	}
+	
+	template<typename Parent, typename Key>
+	string Proxy<Parent, Key>::KeyName() const
+	{
+		_Variable::PushValue(*_State, _Key);
+		return "'" + Variable::FromStack(_State).ToString() + "'";
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	auto Proxy<Parent, Key>::As() const -> decltype(Extensions::AllowedType<T>::GetParameter(nullptr, 0))
+	{
+		typedef decltype(Extensions::AllowedType<T>::GetParameter(nullptr, 0)) Result;
+		
+		Push();
+		try
+		{
+			Result ret = Extensions::AllowedType<T>::GetParameter(*_State, -1);
+			lua_pop(*_State, 1);
+			return ret;
+		}
+		catch(...)
+		{
+			lua_pop(*_State, 1);
+			throw;
+		}
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename T>
+	bool Proxy<Parent, Key>::Is() const
+	{
+		Push();
+		bool ret = Extensions::AllowedType<T>::CheckParameter(*_State, -1);
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename... Args>
+	ReturnValue Proxy<Parent, Key>::operator()(Args&&... args) const
+	{
+		this->Push();
+		
+		int type = lua_type(*_State, -1);
+		if(type != LUA_TFUNCTION)
+		{
+			lua_pop(*_State, 1);
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + lua_typename(*_State, type) + " value)");
+		}
+		
+		return _Variable::Call(_State, std::forward<Args>(args)...);
+	}
+	
+	template<typename Parent, typename Key>
+	template<typename... R, typename... Args>
+	typename CallResult<R...>::type Proxy<Parent, Key>::Call(Args&&... args) const
+	{
+		this->Push();
+		
+		int type = lua_type(*_State, -1);
+		if(type != LUA_TFUNCTION)
+		{
+			lua_pop(*_State, 1);
+			throw RuntimeError("Attempted to call " + KeyName() + " (a " + lua_typename(*_State, type) + " value)");
+		}
+		
+		return _Variable::TypedCall<R...>(_State, std::forward<Args>(args)...);
+	}
+	
+	template<typename Parent, typename Key>
+	PairsRange Proxy<Parent, Key>::pairs() const
+	{
+		Push();
+		
+		int type = lua_type(*_State, -1);
+		if(type != LUA_TTABLE)
+		{
+			lua_pop(*_State, 1);
+			throw RuntimeError("Attempted to pairs " + KeyName() + " (a " + lua_typename(*_State, type) + " value)");
+		}
+		return PairsRange(_State);
+	}
+	
+	template<typename Parent, typename Key>
+	IPairsRange Proxy<Parent, Key>::ipairs() const
+	{
+		Push();
+		
+		int type = lua_type(*_State, -1);
+		if(type != LUA_TTABLE)
+		{
+			lua_pop(*_State, 1);
+			throw RuntimeError("Attempted to ipairs " + KeyName() + " (a " + lua_typename(*_State, type) + " value)");
+		}
+		return IPairsRange(_State);
+	}
+
+	inline Variable::Variable(State* state) :
+		_State(state), _Key(nullptr), _Type(Type::Nil), _ShortLength(0), _Global(false), _Registry(false), _IsInteger(false)
+	{
+		Data.Pointer = nullptr;
+	}
+	
+	inline Variable::Variable(const Variable& other) : Variable(other._State)
+	{
+		CopyValue(other);
+		_Global = other._Global;
+		_Registry = other._Registry;
+		
+		_Key = other._Key;
+		if(_Key)
+			_Key->Count++;
+	}
+	
+	inline Variable::Variable(Variable&& other) :
+		_State(other._State), _Key(other._Key), Data(other.Data),
+		_Type(other._Type), _ShortLength(other._ShortLength), _Global(other._Global), _Registry(other._Registry), _IsInteger(other._IsInteger)
+	{
+		// leave other as a nil that owns nothing
+		other._Key = nullptr;
+		other._Type = Type::Nil;
+	}
+	
+	inline void Variable::CopyValue(const Variable& val)
+	{
+		ReleaseValue();
+		
+		_Type = val._Type;
+		_ShortLength = val._ShortLength;
+		_IsInteger = val._IsInteger;
+		Data = val.Data;
+		
+		switch(_Type)
+		{
+		case Type::String:
+			if(_ShortLength > ShortStringLength)
+				Data.String.Ref->Retain();
+			break;
+		case Type::Function:
+		case Type::Table:
+		case Type::UserData:
+			if(Data.Ref)
+				Data.Ref->Retain();
+			break;
+		default:
+			break;
+		}
+	}
+	
+	inline void Variable::ReleaseValue()
+	{
+		switch(_Type)
+		{
+		case Type::String:
+			if(_ShortLength > ShortStringLength)
+				Data.String.Ref->Release();
+			break;
+		case Type::Function:
+		case Type::Table:
+		case Type::UserData:
+			if(Data.Ref)
+				Data.Ref->Release();
+			break;
+		default:
+			break;
+		}
+		
+		_Type = Type::Nil;
+		Data.Pointer = nullptr;
+	}
+	
+	inline string Variable::KeyName() const
+	{
+		return _Key != nullptr ? "'" + _Key->Key.ToString() + "'" : "an unindexed variable";
+	}
+	
+	inline void Variable::SetAsStack(int index)
+	{
+		_Type = static_cast<Type>(lua_type(*_State, index));
+		_Global = false;
+		_Registry = false;
+		
+		switch (_Type)
+		{
+		case Type::Nil:
+			break;
+		case Type::String:
+		{
+			size_t len;
+			const char* str = lua_tolstring(*_State, index, &len);
+			if(len <= ShortStringLength)
+			{
+				_ShortLength = static_cast<unsigned char>(len);
+				memcpy(Data.ShortString, str, len);
+				Data.ShortString[len] = '\0';
+			}
+			else
+			{
+				// Lua never moves a string, so the bytes stay valid while it's referenced
+				_ShortLength = ShortStringLength + 1;
+				lua_pushvalue(*_State, index);
+				Data.String.Ref = Reference::FromStack(_State);
+				Data.String.Chars = str;
+				Data.String.Length = len;
+			}
+			break;
+		}
+		case Type::Number:
+#if LUA_VERSION_NUM >= 503
+			if(lua_isinteger(*_State, index))
+			{
+				_IsInteger = true;
+				Data.Integer = lua_tointeger(*_State, index);
+				break;
+			}
+#endif
+			Data.Real = lua_tonumber(*_State, index);
+			break;
+		case Type::Boolean:
+			Data.Boolean = lua_toboolean(*_State, index) != 0;
+			break;
+		case Type::LightUserData:
+			Data.Pointer = lua_touserdata(*_State, index);
+			break;
+		case Type::Function:
+		case Type::Table:
+		case Type::UserData:
+			lua_pushvalue(*_State, index);
+			Data.Ref = Reference::FromStack(_State);
+			break;
+		default:
+			throw RuntimeError("The type `" + GetTypeName() + "' hasn't been implimented!");
+		}
+	}
+
+	template <typename T>
+	Variable::Variable(State* state, const T& value) : Variable(state)
+	{
+		Extensions::AllowedType<typename std::remove_reference<T>::type>::Push(*state, value);
+		SetAsStack(-1);
+		lua_pop(*state, 1);
+	}
+
+	template <typename Clazz, typename Ret, typename... Args>
+	Variable Variable::FromMemberFunction(State* state, Ret(Clazz::*func)(Args...))
+	{
+		CppFunction::FunctionWrapper<Ret>::template Member<Clazz, Args...>::store(*state, func);
+
+		return Variable::FromStack(state);
+	}
+
+	template <typename Ret, typename... Args>
+	Variable Variable::FromFunction(State* state, Ret(*func)(Args...))
+	{
+		CppFunction::FunctionWrapper<Ret>::template Static<Args...>::store(*state, func);
+
+		return Variable::FromStack(state);
+	}
+
+	inline Variable Variable::FromStack(State* state, int index)
+	{
+		Variable ret(state);
+		ret.SetAsStack(index);
+		return ret;
+	}
+
+	inline Variable Variable::FromStack(State* state)
+	{
+		Variable ret = FromStack(state, -1);
+		lua_pop(*state, 1);
+		return ret;
+	}
+	
+	inline Variable State::GetRegistry()
+	{
+		Variable ret(this, Type::Nil);
+		ret._Type = Type::Table;
+		ret.Data.Ref = _RegistryRef;
+		ret._Registry = true;
+		_RegistryRef->Retain();
+		return ret;
+	}
+	
+	inline Variable State::GetEnviroment()
+	{
+		Variable ret(this, Type::Nil);
+		ret._Type = Type::Table;
+		ret.Data.Ref = _GlobalsRef;
+		ret._Global = true;
+		_GlobalsRef->Retain();
+		return ret;
+	}
+	
+	inline Variable::Variable(State* state, Type type) : Variable(state)
+	{
+		_Type = type;
+		
+		switch(type)
+		{
+		case Type::Table:
+			lua_newtable(*_State);
+			Data.Ref = Reference::FromStack(_State);
+			break;
+		default:
+			break;
+		}
+	}
+	
+	inline Variable::~Variable()
+	{
+		ReleaseValue();
+		
+		if(_Key && --_Key->Count == 0)
+			delete _Key;
+	}
+	
+	inline void Variable::SetKey(const Variable& key, const Variable& table)
+	{
+		if(_Key && --_Key->Count == 0)
+			delete _Key;
+		
+		_Key = new KeyBinding(table, key);
+	}
+	
+	inline const char* Variable::GetStringData() const
+	{
+		return _ShortLength > ShortStringLength ? Data.String.Chars : Data.ShortString;
+	}
+	
+	inline size_t Variable::GetStringLength() const
+	{
+		return _ShortLength > ShortStringLength ? Data.String.Length : _ShortLength;
+	}
+	
+	inline string Variable::ToString() const
+	{
+		std::stringstream ss;
+		
+		switch(_Type)
+		{
+		case Type::Nil:
+			return "nil";
+		case Type::String:
+			ss << "\"";
+			ss.write(GetStringData(), GetStringLength());
+			ss << "\"";
+			return ss.str();
+		case Type::Number:
+			if(_IsInteger)
+				ss << Data.Integer;
+			else
+				ss << Data.Real;
+			return ss.str();
+		case Type::Boolean:
+			return Data.Boolean ? "true" : "false";
+		case Type::Function:
+			return "[function]";
+		case Type::Table:
+			return "[table]";
+		case Type::UserData:
+			return "[userdata]";
+		case Type::LightUserData:
+			return "[lightuserdata]";
+		default:
+			return "ukn";
+		}
+	}
+	
+	inline Variable Variable::MetaTable() const
+	{
+		this->Push();
+		
+		if(!lua_getmetatable(*_State, -1))
+		{
+			lua_pop(*_State, 1);
+			return Variable(_State, Type::Nil);
+		}
+		
+		Variable ret = Variable::FromStack(_State);
+		assert(ret.GetType() == Type::Table);
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	inline Variable Variable::SetMetaTable(const Variable& tbl)
+	{
+		if(tbl.GetType() != Type::Table)
+			throw RuntimeError("SetMetaTable(): argument is not a table!");
+		
+		this->Push();
+		tbl.Push();
+		
+		lua_setmetatable(*_State, -2);
+		
+		return Variable::FromStack(_State);
+	}
+	
+	inline void Variable::operator=(const LuaTable& t)
+	{
+		*this = Variable(_State, Type::Table);
+	}
+	
+	inline void Variable::operator=(const Variable& val)
+	{
+		if (&val == this) return;
+		if (_Key == nullptr)
+			throw RuntimeError("Variable::operator=() used on an unindexed variable!");
+		if(_Global || _Registry)
+			throw RuntimeError("Variable::operator=() used on global table or register table!");
+		
+		CopyValue(val);
+		
+		_Key->Table.Push();
+		_Key->Key.Push();
+		this->Push();
+		
+		lua_settable(*_State, -3);
+		lua_pop(*_State, 1);
+	}
+	
+	template<typename T>
+	void Variable::operator=(const T& val)
+	{
+		*this = Variable(_State, val);
+	}
+	
+	template<typename T>
+	Proxy<Variable, ProxyKey<T>> Variable::operator[](const T& val) const
+	{
+		return Proxy<Variable, ProxyKey<T>>(_State, *this, val);
+	}
+	
+	inline bool Variable::operator==(const Variable& other) const
+	{
+		try
+		{
+			this->Push();
+			other.Push();
+			bool ret = lua_compare(*_State, -2, -1, LUA_OPEQ) == 1;
+			lua_pop(*_State, 2);
+			return ret;
+		}
+		catch(...)
+		{
+			lua_pop(*_State, 2);
+			throw;
+		}
+	}
+	
+	inline bool Variable::operator<(const Variable& other) const
+	{
+		try
+		{
+			this->Push();
+			other.Push();
+			bool ret = lua_compare(*_State, -2, -1, LUA_OPLT) == 1;
+			lua_pop(*_State, 2);
+			return ret;
+		}
+		catch(...)
+		{
+			lua_pop(*_State, 2);
+			throw;
+		}
+	}
+	
+	inline bool Variable::operator!=(const Variable& other) const
+	{
+		return !operator==(other);
+	}
+	
+	inline bool Variable::operator<=(const Variable& other) const
+	{
+		return operator==(other) || operator<(other);
+	}
+	
+	inline bool Variable::operator>(const Variable& other) const
+	{
+		return operator!=(other) && !operator<(other);
+	}
+	
+	inline bool Variable::operator>=(const Variable& other) const
+	{
+		return operator==(other) || operator>(other);
+	}
+
+	template <typename T>
+	bool Variable::operator==(const T& other) const
+	{
+		try
+		{
+			Extensions::AllowedType<T>::Push(*_State, other);
+			this->Push();
+			bool ret = lua_compare(*_State, -2, -1, LUA_OPEQ) == 1;
+			lua_pop(*_State, 2);
+			return ret;
+		}
+		catch (...)
+		{
+			lua_pop(*_State, 2);
+			throw;
+		}
+	}
+	
+	inline PairsRange Variable::pairs() const
+	{
+		if(GetType() != Type::Table)
+		{
+			throw RuntimeError("Attempted to pairs " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
+		
+		this->Push();
+		return PairsRange(_State);
+	}
+	
+	inline IPairsRange Variable::ipairs() const
+	{
+		if(GetType() != Type::Table)
+		{
+			throw RuntimeError("Attempted to ipairs " + KeyName() + " (a " + GetTypeName() + " value)");
+		}
+		
+		this->Push();
+		return IPairsRange(_State);
+	}
+	
+	template<typename T>
+	size_t Variable::CopyTo(Span<T> out) const
+	{
+		this->Push();
+		size_t ret = Extensions::AllowedType<Span<T>>::Read(*_State, -1, out);
+		lua_pop(*_State, 1);
+		return ret;
+	}
+	
+	inline void Variable::Push() const
+	{
+		switch(_Type)
+		{
+		case Type::Nil:
+			lua_pushnil(*_State);
+			break;
+		case Type::String:
+			if(_ShortLength > ShortStringLength)
+				Data.String.Ref->Push();
+			else
+				lua_pushlstring(*_State, Data.ShortString, _ShortLength);
+			break;
+		case Type::Number:
+			if(_IsInteger)
+				lua_pushinteger(*_State, Data.Integer);
+			else
+				lua_pushnumber(*_State, Data.Real);
+			break;
+		case Type::Boolean:
+			lua_pushboolean(*_State, Data.Boolean);
+			break;
+		case Type::LightUserData:
+			lua_pushlightuserdata(*_State, Data.Pointer);
+			break;
+		case Type::Function:
+		case Type::Table:
+		case Type::UserData:
+			Data.Ref->Push();
+			break;
+		default:
+			throw RuntimeError("The type `" + GetTypeName() + "' hasn't been implimented!");
+		}
+	}
+	
+	inline Type Variable::GetType() const
+	{
+		return _Type;
+	}
+	
+	inline string Variable::GetTypeName() const
+	{
+		return lua_typename(*_State, _Type);
+	}
+	
+	template<typename T>
+	typename Variable::AsType<T>::type Variable::As()
+	{
+		return Extensions::AllowedType<T>::GetFromVar(*this);
+	}
+	
+	template<typename T>
+	bool Variable::Is() const
+	{
+		return Extensions::AllowedType<T>::CheckVar(*this);
+	}
+	
+	namespace Extensions
+	{
+		// a distinct address per type, to key things in the registry with lua_rawgetp instead of hashing a name
+		template <typename T>
+		struct TypeTag
+		{
+			static char Tag;
+		};
+		template <typename T>
+		char TypeTag<T>::Tag = 0;
+		
+		// luaL_newmetatable, but keyed by TypeTag<T>; pushes the metatable and returns true if it needs filling in
+		template <typename T>
+		inline bool NewMetatable(lua_State* L)
+		{
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &TypeTag<T>::Tag);
+			if (!lua_isnil(L, -1))
+				return false;
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, &TypeTag<T>::Tag);
+			return true;
+		}
+		
+		// whether the value at index has the metatable made by NewMetatable<T>
+		template <typename T>
+		inline bool HasMetatable(lua_State* L, int index)
+		{
+			if (!lua_getmetatable(L, index))
+				return false;
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &TypeTag<T>::Tag);
+			bool ret = lua_rawequal(L, -1, -2) != 0;
+			lua_pop(L, 2);
+			return ret;
+		}
+		
+		// every userdata made for a C++ object starts with its type's tag and a pointer to it, so the object
+		// is found the same way whether the userdata holds it by value or through a shared_ptr, and checked
+		// with one pointer compare
+		struct ObjectHeader
+		{
+			const void* Tag; // &TypeTag<T>::Tag
+			void* Pointer;
+		};
+		
+		template <typename T>
+		inline const void* ObjectTag()
+		{
+			return &TypeTag<typename std::remove_cv<T>::type>::Tag;
+		}
+		template <typename T>
+		struct ValueObject
+		{
+			ObjectHeader Header;
+			T Value;
+		};
+		template <typename T>
+		struct SharedObject
+		{
+			ObjectHeader Header;
+			std::shared_ptr<T> Owner;
+		};
+		
+		// the T at index, or null if it holds something else; a light userdata can't be checked and is
+		// taken to be the pointer itself
+		template <typename T>
+		T* ToObject(lua_State* L, int index)
+		{
+			void* ud = lua_touserdata(L, index);
+			if (!ud || lua_type(L, index) == LUA_TLIGHTUSERDATA)
+				return static_cast<T*>(ud);
+			
+			ObjectHeader* header = static_cast<ObjectHeader*>(ud);
+			if (lua_rawlen(L, index) < sizeof(ObjectHeader) || header->Tag != ObjectTag<T>())
+				return nullptr;
+			return static_cast<T*>(header->Pointer);
+		}
+		
+		template <typename T>
+		struct MethodTable {};
+		
+		// pushes the table T's objects look their methods up in
+		template <typename T>
+		inline void PushMethods(lua_State* L)
+		{
+			NewMetatable<MethodTable<T>>(L);
+		}
+		
+		// the property accessors of T, by name, only made once a property is registered
+		template <typename T>
+		struct GetterTable {};
+		template <typename T>
+		struct SetterTable {};
+		
+		// upvalues are the methods and getters, accessors are called in place rather than through lua_call
+		inline int PropertyIndex(lua_State* L)
+		{
+			lua_pushvalue(L, 2);
+			lua_rawget(L, lua_upvalueindex(1));
+			if (!lua_isnil(L, -1))
+				return 1;
+			
+			lua_pushvalue(L, 2);
+			lua_rawget(L, lua_upvalueindex(2));
+			lua_CFunction get = lua_tocfunction(L, -1);
+			if (!get)
+				return 1;
+			lua_settop(L, 1);
+			return get(L);
+		}
+		// upvalue is the setters
+		inline int PropertyNewIndex(lua_State* L)
+		{
+			lua_pushvalue(L, 2);
+			lua_rawget(L, lua_upvalueindex(1));
+			lua_CFunction set = lua_tocfunction(L, -1);
+			if (!set)
+				return luaL_error(L, "no writable property '%s'", luaL_tolstring(L, 2, nullptr));
+			lua_settop(L, 3);
+			lua_remove(L, 2);
+			return set(L);
+		}
+		
+		// sets how the metatable on the top of the stack indexes T's objects: straight into the methods,
+		// or through PropertyIndex/PropertyNewIndex once T has properties
+		template <typename T>
+		inline void SetIndex(lua_State* L)
+		{
+			PushMethods<T>(L);
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &TypeTag<GetterTable<T>>::Tag);
+			if (lua_isnil(L, -1))
+			{
+				lua_pop(L, 1);
+				lua_setfield(L, -2, "__index");
+				return;
+			}
+			lua_pushcclosure(L, PropertyIndex, 2);
+			lua_setfield(L, -2, "__index");
+			lua_rawgetp(L, LUA_REGISTRYINDEX, &TypeTag<SetterTable<T>>::Tag);
+			lua_pushcclosure(L, PropertyNewIndex, 1);
+			lua_setfield(L, -2, "__newindex");
+		}
+		
+		template <typename T, typename Enable>
+		struct AllowedType
+		{
+			static T& GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::UserData)
+				{
+					var.Push();
+					T* ret = ToObject<T>(*var._State, -1);
+					lua_pop(*var._State, 1);
+					if (ret)
+						return *ret;
+				}
+				throw RuntimeError(string("Can not convert Variable to ") + typeid(T).name() + ".");
+			}
+			static void Push(lua_State* L, const T& value)
+			{
+				Emplace(L, value);
+			}
+			// constructs the T inside the userdata
+			template <typename... Args>
+			static void Emplace(lua_State* L, Args&&... args)
+			{
+				ValueObject<T>* ud = static_cast<ValueObject<T>*>(lua_newuserdata(L, sizeof(ValueObject<T>)));
+				new(&ud->Value) T(std::forward<Args>(args)...);
+				ud->Header.Tag = ObjectTag<T>();
+				ud->Header.Pointer = &ud->Value;
+				
+				PushMetatable(L);
+				lua_setmetatable(L, -2);
+			}
+			// every T shares one metatable, trivially destructible types don't get a __gc at all; the metatable
+			// is protected so scripts can't reach __gc and destroy an object twice
+			static void PushMetatable(lua_State* L)
+			{
+				if(NewMetatable<T>(L))
+				{
+					if(!std::is_trivially_destructible<T>::value)
+					{
+						lua_pushcfunction(L, Destroy);
+						lua_setfield(L, -2, "__gc");
+					}
+					SetIndex<T>(L);
+					lua_pushstring(L, "object");
+					lua_setfield(L, -2, "__metatable");
+				}
+			}
+			// the tag is cleared first, so a second call, or a later lookup, finds nothing to destroy
+			static int Destroy(lua_State* L)
+			{
+				ValueObject<T>* self = static_cast<ValueObject<T>*>(lua_touserdata(L, 1));
+				if(lua_type(L, 1) != LUA_TUSERDATA || lua_rawlen(L, 1) < sizeof(ValueObject<T>) || self->Header.Tag != ObjectTag<T>())
+					return 0;
+				self->Header.Tag = nullptr;
+				self->Value.~T();
+				return 0;
+			}
+
+			static bool CheckVar(const Variable& var)
+			{
+				if (var.GetType() != Type::UserData)
+					return false;
+				var.Push();
+				bool ret = CheckParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+
+			static T& GetParameter(lua_State* L, int count)
+			{
+				T* ret = ToObject<T>(L, count);
+				if (!ret || lua_type(L, count) != LUA_TUSERDATA)
+					throw RuntimeError(string("Can not convert ") + luaL_typename(L, count) + " to " + typeid(T).name() + ".");
+				return *ret;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TUSERDATA && ToObject<T>(L, count) != nullptr;
+			}
+		};
+		// integers go through lua_Integer and never touch a double unless the value is one
+		template <typename T>
+		struct IntegerType
+		{
+			static T GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::Number)
+				{
+					return var.IsInteger() ? static_cast<T>(var.Data.Integer) : static_cast<T>(var.Data.Real);
+				}
+				return 0;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Number;
+			}
+			static T GetParameter(lua_State* L, int count)
+			{
+				int isint;
+				lua_Integer ret = lua_tointegerx(L, count, &isint);
+				if (isint)
+					return static_cast<T>(ret);
+				return static_cast<T>(lua_tonumber(L, count));
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TNUMBER;
+			}
+			static void Push(lua_State* L, T value)
+			{
+				lua_pushinteger(L, static_cast<lua_Integer>(value));
+			}
+		};
+		
+		template <typename T>
+		struct FloatType
+		{
+			static T GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::Number)
+				{
+					return var.IsInteger() ? static_cast<T>(var.Data.Integer) : static_cast<T>(var.Data.Real);
+				}
+				return 0;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Number;
+			}
+			static T GetParameter(lua_State* L, int count)
+			{
+				return static_cast<T>(lua_tonumber(L, count));
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TNUMBER;
+			}
+			static void Push(lua_State* L, T value)
+			{
+				lua_pushnumber(L, static_cast<lua_Number>(value));
+			}
+		};
+		
+		// every fundamental type, so int64_t, uint32_t, size_t etc. are covered on any platform
+		template <> struct AllowedType<short> : public IntegerType<short> {};
+		template <> struct AllowedType<unsigned short> : public IntegerType<unsigned short> {};
+		template <> struct AllowedType<int> : public IntegerType<int> {};
+		template <> struct AllowedType<unsigned int> : public IntegerType<unsigned int> {};
+		template <> struct AllowedType<long> : public IntegerType<long> {};
+		template <> struct AllowedType<unsigned long> : public IntegerType<unsigned long> {};
+		template <> struct AllowedType<long long> : public IntegerType<long long> {};
+		template <> struct AllowedType<unsigned long long> : public IntegerType<unsigned long long> {};
+		template <> struct AllowedType<float> : public FloatType<float> {};
+		template <> struct AllowedType<double> : public FloatType<double> {};
+
+		template <>
+		struct AllowedType<bool>
+		{
+			static bool GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::Boolean)
+				{
+					return var.Data.Boolean;
+				}
+				return false;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Boolean;
+			}
+			static bool GetParameter(lua_State* L, int count)
+			{
+				return lua_toboolean(L, count) != 0;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TBOOLEAN;
+			}
+			static void Push(lua_State* L, bool value)
+			{
+				lua_pushboolean(L, value);
+			}
+		};
+		template <size_t LEN>
+		struct AllowedType<const char[LEN]>
+		{
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::String;
+			}
+			static const char* GetParameter(lua_State* L, int count)
+			{
+				return lua_tostring(L, count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TSTRING;
+			}
+			// up to the first terminator, which a literal has at LEN - 1 but a partly filled array has sooner;
+			// the scan never reads past the array
+			static void Push(lua_State* L, const char* value)
+			{
+				lua_pushlstring(L, value, std::find(value, value + LEN, '\0') - value);
+			}
+		};
+		
+		template <size_t LEN>
+		struct AllowedType<char[LEN]> : public AllowedType<const char[LEN]>
+		{};
+
+		template <>
+		struct AllowedType<const char*>
+		{
+			static const char* GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::String)
+				{
+					return var.GetStringData();
+				}
+				return nullptr;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::String;
+			}
+			static const char* GetParameter(lua_State* L, int count)
+			{
+				return lua_tostring(L, count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TSTRING;
+			}
+			static void Push(lua_State* L, const char* value)
+			{
+				if(value)
+					lua_pushlstring(L, value, std::strlen(value));
+				else
+					lua_pushnil(L);
+			}
+		};
+
+		template <>
+		struct AllowedType<string>
+		{
+			static string GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::String)
+				{
+					return string(var.GetStringData(), var.GetStringLength());
+				}
+				return string();
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::String;
+			}
+			static string GetParameter(lua_State* L, int count)
+			{
+				size_t len;
+				const char* str = lua_tolstring(L, count, &len);
+				return str ? string(str, len) : string();
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TSTRING;
+			}
+			static void Push(lua_State* L, const string& value)
+			{
+				lua_pushlstring(L, value.data(), value.size());
+			}
+		};
+		
+#if __cplusplus >= 201703L
+		// views point into the Lua string, so only live as long as it is referenced
+		template <>
+		struct AllowedType<std::string_view>
+		{
+			static std::string_view GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::String)
+				{
+					return var.GetStringView();
+				}
+				return std::string_view();
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::String;
+			}
+			static std::string_view GetParameter(lua_State* L, int count)
+			{
+				size_t len;
+				const char* str = lua_tolstring(L, count, &len);
+				return str ? std::string_view(str, len) : std::string_view();
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TSTRING;
+			}
+			static void Push(lua_State* L, std::string_view value)
+			{
+				lua_pushlstring(L, value.data(), value.size());
+			}
+		};
+#endif
+
+		template <typename T>
+		struct AllowedType<T*>
+		{
+			static T* GetFromVar(const Variable& var)
+			{
+				if (var.GetType() == Type::LightUserData || var.GetType() == Type::UserData)
+				{
+					var.Push();
+					T* ret = ToObject<T>(*var._State, -1);
+					lua_pop(*var._State, 1);
+					return ret;
+				}
+				return nullptr;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::LightUserData || var.GetType() == Type::UserData;
+			}
+			static T* GetParameter(lua_State* L, int count)
+			{
+				return ToObject<T>(L, count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TLIGHTUSERDATA || ToObject<T>(L, count) != nullptr;
+			}
+			static void Push(lua_State* L, T* value)
+			{
+				lua_pushlightuserdata(L, value);
+			}
+		};
+		
+		// lets bound functions take their arguments as views, without copying them
+		template <>
+		struct AllowedType<StackRef>
+		{
+			static StackRef GetParameter(lua_State* L, int count)
+			{
+				return StackRef(State::FromLuaState(L), count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return true;
+			}
+			static void Push(lua_State* L, const StackRef& value)
+			{
+				lua_pushvalue(L, value._Index);
+			}
+		};
+		
+		// takes every remaining argument
+		template <>
+		struct AllowedType<StackRange>
+		{
+			static StackRange GetParameter(lua_State* L, int count)
+			{
+				return StackRange(State::FromLuaState(L), count, std::max(lua_gettop(L) - count + 1, 0));
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return true;
+			}
+		};
+		
+		// callables whose operator() can be named, such as lambdas, which excludes templated ones
+		template <typename F, typename = void>
+		struct IsCallable : std::false_type {};
+		template <typename F>
+		struct IsCallable<F, decltype((void)&F::operator())> : std::true_type {};
+		
+		// a callable is copied into a userdata kept as the upvalue of a C closure, so calling it is a
+		// lua_touserdata away; its type shares one cached __gc metatable, if it needs one at all
+		template <typename F, typename Ret, typename... Args>
+		struct Closure
+		{
+			template <int... N>
+			static int call(lua_State* L, F& func, CppFunction::seq<N...>)
+			{
+				return CppFunction::Returns<Ret>::push(L, [L, &func]() -> Ret {
+					return func(AllowedType<typename std::decay<Args>::type>::GetParameter(L, N + 1)...);
+				});
+			}
+			static int invoke(lua_State* L)
+			{
+				F* func = static_cast<F*>(lua_touserdata(L, lua_upvalueindex(1)));
+				return call(L, *func, typename CppFunction::gens<sizeof...(Args)>::type());
+			}
+			static int destroy(lua_State* L)
+			{
+				static_cast<F*>(lua_touserdata(L, 1))->~F();
+				return 0;
+			}
+			static void Push(lua_State* L, const F& func)
+			{
+				new(lua_newuserdata(L, sizeof(F))) F(func);
+				if (!std::is_trivially_destructible<F>::value)
+				{
+					if (NewMetatable<Closure>(L))
+					{
+						lua_pushcfunction(L, destroy);
+						lua_setfield(L, -2, "__gc");
+					}
+					lua_setmetatable(L, -2);
+				}
+				lua_pushcclosure(L, CppFunction::Protected<invoke>, 1);
+			}
+		};
+		
+		template <typename Method, typename F>
+		struct ClosureOf;
+		template <typename Clazz, typename Ret, typename... Args, typename F>
+		struct ClosureOf<Ret(Clazz::*)(Args...), F>
+		{
+			typedef Closure<F, Ret, Args...> type;
+		};
+		template <typename Clazz, typename Ret, typename... Args, typename F>
+		struct ClosureOf<Ret(Clazz::*)(Args...) const, F>
+		{
+			typedef Closure<F, Ret, Args...> type;
+		};
+		
+		template <typename F>
+		struct AllowedType<F, typename std::enable_if<IsCallable<F>::value>::type>
+		{
+			typedef typename ClosureOf<decltype(&F::operator()), F>::type Closure;
+			
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TFUNCTION;
+			}
+			static void Push(lua_State* L, const F& value)
+			{
+				Closure::Push(L, value);
+			}
+		};
+		
+#if __cplusplus >= 201703L
+		// an empty optional is nil
+		template <typename T>
+		struct AllowedType<std::optional<T>>
+		{
+			static std::optional<T> GetFromVar(const Variable& var)
+			{
+				var.Push();
+				std::optional<T> ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				var.Push();
+				bool ret = CheckParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static std::optional<T> GetParameter(lua_State* L, int count)
+			{
+				if (lua_isnoneornil(L, count))
+					return std::nullopt;
+				return AllowedType<T>::GetParameter(L, count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_isnoneornil(L, count) || AllowedType<T>::CheckParameter(L, count);
+			}
+			static void Push(lua_State* L, const std::optional<T>& value)
+			{
+				if (value)
+					AllowedType<T>::Push(L, *value);
+				else
+					lua_pushnil(L);
+			}
+		};
+#endif
+		
+		template <>
+		struct AllowedType<lua_CFunction>
+		{
+			static lua_CFunction GetFromVar(const Variable& var)
+			{
+				var.Push();
+				lua_CFunction ret = lua_tocfunction(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Function;
+			}
+			static lua_CFunction GetParameter(lua_State* L, int count)
+			{
+				return lua_tocfunction(L, count);
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_iscfunction(L, count) != 0;
+			}
+			static void Push(lua_State* L, lua_CFunction value)
+			{
+				lua_pushcfunction(L, value);
+			}
+		};
+		
+		// arrays are pushed presized with lua_createtable and filled with lua_rawseti,
+		// and read back with lua_rawgeti into storage sized up front from lua_rawlen
+		template <typename T>
+		struct AllowedType<Span<T>>
+		{
+			typedef typename std::remove_const<T>::type Element;
+			
+			static void Push(lua_State* L, Span<T> value)
+			{
+				lua_createtable(L, static_cast<int>(value.Size), 0);
+				for (size_t i = 0; i < value.Size; i++)
+				{
+					AllowedType<Element>::Push(L, value.Data[i]);
+					lua_rawseti(L, -2, i + 1);
+				}
+			}
+			static size_t Read(lua_State* L, int count, Span<Element> out)
+			{
+				if (lua_type(L, count) != LUA_TTABLE)
+					return 0;
+				
+				count = lua_absindex(L, count);
+				size_t len = std::min(static_cast<size_t>(lua_rawlen(L, count)), out.Size);
+				for (size_t i = 0; i < len; i++)
+				{
+					lua_rawgeti(L, count, i + 1);
+					out.Data[i] = AllowedType<Element>::GetParameter(L, -1);
+					lua_pop(L, 1);
+				}
+				return len;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TTABLE;
+			}
+		};
+		
+		// one userdata holding the shared_ptr, sharing T's methods with objects pushed by value
+		template <typename T>
+		struct AllowedType<std::shared_ptr<T>>
+		{
+			static std::shared_ptr<T> GetFromVar(const Variable& var)
+			{
+				var.Push();
+				std::shared_ptr<T> ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				var.Push();
+				bool ret = CheckParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static std::shared_ptr<T> GetParameter(lua_State* L, int count)
+			{
+				if (!CheckParameter(L, count))
+					return nullptr;
+				return static_cast<SharedObject<T>*>(lua_touserdata(L, count))->Owner;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				// a destroyed object keeps its metatable but not its tag
+				return lua_type(L, count) == LUA_TUSERDATA && HasMetatable<SharedObject<T>>(L, count)
+					&& static_cast<ObjectHeader*>(lua_touserdata(L, count))->Tag == ObjectTag<T>();
+			}
+			static void Push(lua_State* L, const std::shared_ptr<T>& value)
+			{
+				SharedObject<T>* ud = static_cast<SharedObject<T>*>(lua_newuserdata(L, sizeof(SharedObject<T>)));
+				new(&ud->Owner) std::shared_ptr<T>(value);
+				ud->Header.Tag = ObjectTag<T>();
+				ud->Header.Pointer = value.get();
+				
+				PushMetatable(L);
+				lua_setmetatable(L, -2);
+			}
+			static void PushMetatable(lua_State* L)
+			{
+				if(NewMetatable<SharedObject<T>>(L))
+				{
+					lua_pushcfunction(L, Destroy);
+					lua_setfield(L, -2, "__gc");
+					SetIndex<T>(L);
+					lua_pushstring(L, "object");
+					lua_setfield(L, -2, "__metatable");
+				}
+			}
+			static int Destroy(lua_State* L)
+			{
+				SharedObject<T>* self = static_cast<SharedObject<T>*>(lua_touserdata(L, 1));
+				if(lua_type(L, 1) != LUA_TUSERDATA || lua_rawlen(L, 1) < sizeof(SharedObject<T>) || self->Header.Tag != ObjectTag<T>())
+					return 0;
+				self->Header.Tag = nullptr;
+				self->Owner.~shared_ptr();
+				return 0;
+			}
+		};
+		
+		// a buffer is a userdata holding a Buffer<T>, followed by the elements when it owns them; the
+		// metamethods are looked up once per element type and the protected metatable lets them trust self
+		template <typename T>
+		struct AllowedType<Buffer<T>>
+		{
+			static Buffer<T>& GetFromVar(const Variable& var)
+			{
+				var.Push();
+				Buffer<T>& ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				var.Push();
+				bool ret = CheckParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static Buffer<T>& GetParameter(lua_State* L, int count)
+			{
+				if (!CheckParameter(L, count))
+					throw RuntimeError(string("Can not convert ") + luaL_typename(L, count) + " to a buffer.");
+				return *static_cast<Buffer<T>*>(lua_touserdata(L, count));
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TUSERDATA && HasMetatable<Buffer<T>>(L, count);
+			}
+			// a view of the memory, it is not copied
+			static void Push(lua_State* L, const Buffer<T>& value)
+			{
+				new(lua_newuserdata(L, sizeof(Buffer<T>))) Buffer<T>(value);
+				PushMetatable(L);
+				lua_setmetatable(L, -2);
+			}
+			
+			static void PushMetatable(lua_State* L)
+			{
+				if (!NewMetatable<Buffer<T>>(L))
+					return;
+				
+				lua_createtable(L, 0, 1);
+				lua_pushcfunction(L, Slice);
+				lua_setfield(L, -2, "slice");
+				lua_pushcclosure(L, Index, 1);
+				lua_setfield(L, -2, "__index");
+				lua_pushcfunction(L, NewIndex);
+				lua_setfield(L, -2, "__newindex");
+				lua_pushcfunction(L, Length);
+				lua_setfield(L, -2, "__len");
+				lua_pushstring(L, "buffer");
+				lua_setfield(L, -2, "__metatable");
+			}
+			
+			// out of range reads give nil like a table would, anything that isn't a number is a method
+			static int Index(lua_State* L)
+			{
+				Buffer<T>* self = static_cast<Buffer<T>*>(lua_touserdata(L, 1));
+				int isint;
+				lua_Integer index = lua_tointegerx(L, 2, &isint);
+				if (isint)
+				{
+					if (index < 1 || static_cast<size_t>(index) > self->Size)
+						return 0;
+					AllowedType<T>::Push(L, self->Data[index - 1]);
+					return 1;
+				}
+				lua_pushvalue(L, 2);
+				lua_rawget(L, lua_upvalueindex(1));
+				return 1;
+			}
+			static int NewIndex(lua_State* L)
+			{
+				Buffer<T>* self = static_cast<Buffer<T>*>(lua_touserdata(L, 1));
+				int isint;
+				lua_Integer index = lua_tointegerx(L, 2, &isint);
+				if (!isint || index < 1 || static_cast<size_t>(index) > self->Size)
+					return luaL_error(L, "buffer index out of range");
+				if (!AllowedType<T>::CheckParameter(L, 3))
+					return luaL_argerror(L, 3, "number expected");
+				self->Data[index - 1] = AllowedType<T>::GetParameter(L, 3);
+				return 0;
+			}
+			static int Length(lua_State* L)
+			{
+				lua_pushinteger(L, static_cast<lua_Integer>(static_cast<Buffer<T>*>(lua_touserdata(L, 1))->Size));
+				return 1;
+			}
+			// buf:slice(first, last) views elements first to last inclusive, and keeps buf alive
+			static int Slice(lua_State* L)
+			{
+				luaL_argcheck(L, CheckParameter(L, 1), 1, "buffer expected");
+				Buffer<T>* self = static_cast<Buffer<T>*>(lua_touserdata(L, 1));
+				lua_Integer first = luaL_optinteger(L, 2, 1);
+				lua_Integer last = luaL_optinteger(L, 3, static_cast<lua_Integer>(self->Size));
+				if (first < 1 || last < first - 1 || static_cast<size_t>(last) > self->Size)
+					return luaL_error(L, "slice out of range");
+				
+				Push(L, Buffer<T>(self->Data + first - 1, static_cast<size_t>(last - first + 1)));
+#if LUA_VERSION_NUM >= 503
+				lua_pushvalue(L, 1);
+#else
+				lua_createtable(L, 1, 0); // 5.2 only takes a table
+				lua_pushvalue(L, 1);
+				lua_rawseti(L, -2, 1);
+#endif
+				lua_setuservalue(L, -2);
+				return 1;
+			}
+		};
+		
+		template <typename T>
+		struct AllowedType<std::vector<T>>
+		{
+			static std::vector<T> GetFromVar(const Variable& var)
+			{
+				var.Push();
+				std::vector<T> ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Table;
+			}
+			static std::vector<T> GetParameter(lua_State* L, int count)
+			{
+				std::vector<T> ret;
+				if (lua_type(L, count) != LUA_TTABLE)
+					return ret;
+				
+				count = lua_absindex(L, count);
+				size_t len = lua_rawlen(L, count);
+				ret.reserve(len);
+				for (size_t i = 0; i < len; i++)
+				{
+					lua_rawgeti(L, count, i + 1);
+					ret.push_back(AllowedType<T>::GetParameter(L, -1));
+					lua_pop(L, 1);
+				}
+				return ret;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TTABLE;
+			}
+			static void Push(lua_State* L, const std::vector<T>& value)
+			{
+				lua_createtable(L, static_cast<int>(value.size()), 0);
+				for (size_t i = 0; i < value.size(); i++)
+				{
+					AllowedType<T>::Push(L, value[i]);
+					lua_rawseti(L, -2, i + 1);
+				}
+			}
+		};
+		
+		template <typename T, size_t N>
+		struct AllowedType<std::array<T, N>>
+		{
+			static std::array<T, N> GetFromVar(const Variable& var)
+			{
+				var.Push();
+				std::array<T, N> ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Table;
+			}
+			static std::array<T, N> GetParameter(lua_State* L, int count)
+			{
+				std::array<T, N> ret = {};
+				AllowedType<Span<T>>::Read(L, count, Span<T>(ret.data(), N));
+				return ret;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TTABLE;
+			}
+			static void Push(lua_State* L, const std::array<T, N>& value)
+			{
+				AllowedType<Span<const T>>::Push(L, Span<const T>(value.data(), N));
+			}
+		};
+		
+		// maps are pushed as a presized hash table and read back in one lua_next sweep,
+		// entries whose key isn't a K are skipped
+		template <typename Map>
+		struct MapType
+		{
+			typedef typename Map::key_type Key;
+			typedef typename Map::mapped_type Value;
+			
+			static Map GetFromVar(const Variable& var)
+			{
+				var.Push();
+				Map ret = GetParameter(*var._State, -1);
+				lua_pop(*var._State, 1);
+				return ret;
+			}
+			static bool CheckVar(const Variable& var)
+			{
+				return var.GetType() == Type::Table;
+			}
+			static Map GetParameter(lua_State* L, int count)
+			{
+				Map ret;
+				if (lua_type(L, count) != LUA_TTABLE)
+					return ret;
+				
+				count = lua_absindex(L, count);
+				lua_pushnil(L);
+				while (lua_next(L, count))
+				{
+					// convert a copy of the key, lua_tostring on the real one would confuse lua_next
+					lua_pushvalue(L, -2);
+					if (AllowedType<Key>::CheckParameter(L, -1))
+						ret.emplace(AllowedType<Key>::GetParameter(L, -1), AllowedType<Value>::GetParameter(L, -2));
+					lua_pop(L, 2);
+				}
+				return ret;
+			}
+			static bool CheckParameter(lua_State* L, int count)
+			{
+				return lua_type(L, count) == LUA_TTABLE;
+			}
+			static void Push(lua_State* L, const Map& value)
+			{
+				lua_createtable(L, 0, static_cast<int>(value.size()));
+				for (const auto& pair : value)
+				{
+					AllowedType<Key>::Push(L, pair.first);
+					AllowedType<Value>::Push(L, pair.second);
+					lua_rawset(L, -3);
+				}
+			}
+		};
+		
+		template <typename K, typename V, typename Compare, typename Alloc>
+		struct AllowedType<std::map<K, V, Compare, Alloc>> : public MapType<std::map<K, V, Compare, Alloc>> {};
+		
+		template <typename K, typename V, typename Hash, typename Equal, typename Alloc>
+		struct AllowedType<std::unordered_map<K, V, Hash, Equal, Alloc>> : public MapType<std::unordered_map<K, V, Hash, Equal, Alloc>> {};
+		
+#if __cplusplus >= 202002L
+		template <typename T, size_t N>
+		struct AllowedType<std::span<T, N>>
+		{
+			static void Push(lua_State* L, std::span<T, N> value)
+			{
+				AllowedType<Span<T>>::Push(L, Span<T>(value.data(), value.size()));
+			}
+		};
+#endif
+	}
+	
+	// spells a function as the two template arguments ClassBuilder takes on C++11: Method<LUAPP_FUNC(&T::f)>()
+#define LUAPP_FUNC(func) decltype(func), func
+	
+	template<typename Signature, typename F>
+	struct SignedCallable;
+	template<typename Ret, typename... Args, typename F>
+	struct SignedCallable<Ret(Args...), F>
+	{
+		F Func;
+		Ret operator()(Args... args)
+		{
+			return Func(std::forward<Args>(args)...);
+		}
+	};
+	
+	// gives a callable whose operator() is a template, a std::bind result or generic lambda, the
+	// signature Lua should call it with: state["f"] = Callable<int(int)>(std::bind(...))
+	template<typename Signature, typename F>
+	SignedCallable<Signature, F> Callable(F func)
+	{
+		return SignedCallable<Signature, F>{ std::move(func) };
+	}
+	
+	// a free, static or member function as a bare lua_CFunction, with no closure or upvalue behind it:
+	// Bind<LUAPP_FUNC(&f)>(), or Bind<&f>() on C++17; member functions take their object first
+	template<typename Func, Func func>
+	constexpr lua_CFunction Bind()
+	{
+		return CppFunction::Protected<CppFunction::Dispatch<Func, func>::invoke>;
 	}
+#if __cplusplus >= 201703L
+	template<auto func>
+	constexpr lua_CFunction Bind()
+	{
+		return CppFunction::Protected<CppFunction::Dispatch<decltype(func), func>::invoke>;
+	}
+#endif
 	
-	inline void Variable::operator=(const LuaTable& t)
+	// registers T's methods, static functions, constructors and properties into the one table its objects
+	// index; every function is a template argument, so a call goes straight to it with no upvalue to read
+	template<typename T>
+	class ClassBuilder
 	{
-		if (_KeyTo == nullptr)
-			throw RuntimeError("_KeyTo is null!");
-
-		// clear Ref as soon as possible
-		this->Ref = nullptr;
-
-		Variable tmp(_State, Type::Table);
-		this->_IsReference = tmp._IsReference;
-		this->_Type = tmp._Type;
-		this->Data = tmp.Data;
-		
-		if(_Type == Type::String)
-			this->String = tmp.String;
-		else if(_IsReference)
-			this->Ref = tmp.Ref;
+		State* _State;
 		
-		if(_Global || _Registry)
+		void Set(const char* name, lua_CFunction func)
 		{
-			throw RuntimeError("Variable::operator=() used on global or register table!");
+			Extensions::PushMethods<T>(*_State);
+			lua_pushcfunction(*_State, func);
+			lua_setfield(*_State, -2, name);
+			lua_pop(*_State, 1);
 		}
-		else
+		void SetAccessor(const void* table, const char* name, lua_CFunction func)
 		{
-			_KeyTo->Push();
-			_Key->Push();
-			tmp.Push();
-			
-			lua_settable(*_State, -3);
+			lua_rawgetp(*_State, LUA_REGISTRYINDEX, table);
+			lua_pushcfunction(*_State, func);
+			lua_setfield(*_State, -2, name);
 			lua_pop(*_State, 1);
 		}
-	}
-	
-	inline void Variable::operator=(const Variable& val)
-	{
-		if (&val == this) return;
-		if (_KeyTo == nullptr)
-			throw RuntimeError("_KeyTo is null!");
-
-		this->Ref = nullptr;
-
-		this->_IsReference = val._IsReference;
-		this->_Type = val._Type;
-		this->Data = val.Data;
-		
-		if(_Type == Type::String)
-			this->String = val.String;
-		else if(_IsReference)
-			this->Ref = val.Ref;
+	public:
+		explicit ClassBuilder(State* state) : _State(state) {}
 		
-		if(_Global || _Registry)
+		// obj:name(...)
+		template<typename Func, Func func>
+		ClassBuilder& Method(const char* name)
 		{
-			throw RuntimeError("Variable::operator=() used on global table or register table!");
+			static_assert(std::is_member_function_pointer<Func>::value, "Method() takes a member function");
+			Set(name, CppFunction::Protected<CppFunction::Dispatch<Func, func>::invoke>);
+			return *this;
 		}
-		else
+		
+		// Class.name(...)
+		template<typename Func, Func func>
+		ClassBuilder& Static(const char* name)
 		{
-			_KeyTo->Push();
-			_Key->Push();
-			this->Push();
-			
-			lua_settable(*_State, -3);
-			lua_pop(*_State, 1);
+			Set(name, CppFunction::Protected<CppFunction::Dispatch<Func, func>::invoke>);
+			return *this;
 		}
-	}
-	
-	template<typename T>
-	void Variable::operator=(const T& val)
-	{
-		if (_KeyTo == nullptr)
-			throw RuntimeError("_KeyTo is null!");
-
-		this->Ref = nullptr;
-
-		Variable tmp(_State, val);
-		this->_IsReference = tmp._IsReference;
-		this->_Type = tmp._Type;
-		this->Data = tmp.Data;
-
-		if (_Type == Type::String)
-			this->String = tmp.String;
-		else if (_IsReference)
-			this->Ref = tmp.Ref;
-
-		if(_Global || _Registry)
+		
+		// Class.name(...) makes a T by value
+		template<typename... Args>
+		ClassBuilder& Constructor(const char* name = "new")
 		{
-			throw RuntimeError("Variable::operator=() used on global table or reference table!");
+			Set(name, CppFunction::Protected<CppFunction::Constructor<T, Args...>::invoke>);
+			return *this;
 		}
-		else
+		
+		// obj.name, read and written in place
+		template<typename Member, Member member>
+		ClassBuilder& Property(const char* name)
 		{
-			Variable tmp(_State, val);
-			this->_IsReference = tmp._IsReference;
-			this->_Type = tmp._Type;
-			this->Data = tmp.Data;
-			
-			if(_Type == Type::String)
-				this->String = tmp.String;
-			else if(_IsReference)
-				this->Ref = tmp.Ref;
+			static_assert(std::is_member_object_pointer<Member>::value, "Property() takes a data member");
+			lua_State* L = *_State;
 			
-			_KeyTo->Push();
-			_Key->Push();
-			tmp.Push();
+			Extensions::NewMetatable<Extensions::GetterTable<T>>(L);
+			Extensions::NewMetatable<Extensions::SetterTable<T>>(L);
+			lua_pop(L, 2);
+			SetAccessor(&Extensions::TypeTag<Extensions::GetterTable<T>>::Tag, name, CppFunction::Protected<CppFunction::Property<Member, member>::get>);
+			SetAccessor(&Extensions::TypeTag<Extensions::SetterTable<T>>::Tag, name, CppFunction::Protected<CppFunction::Property<Member, member>::set>);
 			
-			lua_settable(*_State, -3);
-			lua_pop(*_State, 1);
+			// objects pushed before now have to see the properties too
+			Extensions::AllowedType<T>::PushMetatable(L);
+			Extensions::SetIndex<T>(L);
+			Extensions::AllowedType<std::shared_ptr<T>>::PushMetatable(L);
+			Extensions::SetIndex<T>(L);
+			lua_pop(L, 2);
+			return *this;
 		}
-	}
-	
-	template<typename T>
-	Variable Variable::operator[](const T& val)
-	{
-		if(GetType() != Type::Table)
+		
+#if __cplusplus >= 201703L
+		template<auto func>
+		ClassBuilder& Method(const char* name)
 		{
-			throw RuntimeError("Attempted to index '" + _Key->ToString() + "' (a " + GetTypeName() + " value)");
+			return Method<decltype(func), func>(name);
 		}
-		
-		std::shared_ptr<Variable> key = std::make_shared<Variable>(_State, val);
-		
-		// push table
-		// push key
-		// tell lua to index the table -2, with -1
-		
-		this->Push();
-		key->Push();
-		
-		lua_gettable(*_State, -2);
-		
-		Variable ret = Variable::FromStack(_State); // takes it from the stack
-		ret.SetKey(key, this);
-		
-		lua_pop(*_State, 1);
-		return ret;
-	}
-	
-	inline bool Variable::operator==(const Variable& other) const
-	{
-		try
+		template<auto func>
+		ClassBuilder& Static(const char* name)
 		{
-			this->Push();
-			other.Push();
-			bool ret = lua_compare(*_State, -2, -1, LUA_OPEQ) == 1;
-			lua_pop(*_State, 2);
-			return ret;
+			return Static<decltype(func), func>(name);
 		}
-		catch(...)
+		template<auto member>
+		ClassBuilder& Property(const char* name)
 		{
-			lua_pop(*_State, 2);
-			throw;
+			return Property<decltype(member), member>(name);
 		}
-	}
+#endif
+	};
 	
-	inline bool Variable::operator<(const Variable& other) const
+	template<typename T>
+	ClassBuilder<T> State::RegisterClass(const string& name)
 	{
-		try
+		if(!name.empty())
 		{
-			this->Push();
-			other.Push();
-			bool ret = lua_compare(*_State, -2, -1, LUA_OPLT) == 1;
-			lua_pop(*_State, 2);
-			return ret;
-		}
-		catch(...)
-		{
-			lua_pop(*_State, 2);
-			throw;
+			Extensions::PushMethods<T>(_State);
+			_Variable::GlobalKey<Globals, string>::Set(_State, name);
 		}
+		return ClassBuilder<T>(this);
 	}
 	
-	inline bool Variable::operator!=(const Variable& other) const
-	{
-		return !operator==(other);
-	}
-	
-	inline bool Variable::operator<=(const Variable& other) const
+	template<typename T>
+	Variable State::GetMethods()
 	{
-		return operator==(other) || operator<(other);
+		Extensions::PushMethods<T>(_State);
+		return Variable::FromStack(this);
 	}
 	
-	inline bool Variable::operator>(const Variable& other) const
+	template<typename T>
+	Variable Buffer<T>::New(State* state, size_t size)
 	{
-		return operator!=(other) && !operator<(other);
+		lua_State* L = *state;
+		const uintptr_t align = Alignment;
+		void* ud = lua_newuserdata(L, sizeof(Buffer<T>) + align - 1 + size * sizeof(T));
+		uintptr_t data = reinterpret_cast<uintptr_t>(static_cast<Buffer<T>*>(ud) + 1);
+		T* elements = reinterpret_cast<T*>((data + align - 1) & ~(align - 1));
+		std::memset(elements, 0, size * sizeof(T));
+		new(ud) Buffer<T>(elements, size);
+		
+		Extensions::AllowedType<Buffer<T>>::PushMetatable(L);
+		lua_setmetatable(L, -2);
+		return Variable::FromStack(state);
 	}
 	
-	inline bool Variable::operator>=(const Variable& other) const
+	// a compact binary form of Lua values, to move them between states or processes: nil, booleans,
+	// integers, floats, strings, tables (shared and cyclic ones stay shared, metatables are dropped)
+	// and value userdata of types given to Register. floats and userdata are written in the host's byte order
+	class Serializer
 	{
-		return operator==(other) || operator>(other);
-	}
-
-	template <typename T>
-	bool Variable::operator==(const T& other) const
-	{
-		try
+		enum Tag : unsigned char
 		{
-			Extensions::AllowedType<T>::Push(*_State, other);
-			this->Push();
-			bool ret = lua_compare(*_State, -2, -1, LUA_OPEQ) == 1;
-			lua_pop(*_State, 2);
-			return ret;
+			Nil, False, True, Integer, Float, String, Table, Reference, UserData
+		};
+		
+		struct Entry
+		{
+			string Name;
+			size_t Size;
+			void (*Push)(lua_State* L, const char* data);
+		};
+		
+		// both filled by Register, which should be done before any thread encodes or decodes
+		static std::unordered_map<const void*, Entry>& ByTag()
+		{
+			static std::unordered_map<const void*, Entry> types;
+			return types;
 		}
-		catch (...)
+		static std::unordered_map<string, const Entry*>& ByName()
 		{
-			lua_pop(*_State, 2);
-			throw;
+			static std::unordered_map<string, const Entry*> types;
+			return types;
 		}
-	}
-	
-	inline std::vector<std::pair<Variable, Variable>> Variable::pairs()
-	{
-		if(GetType() != Type::Table)
+		
+		template<typename T>
+		static void PushObject(lua_State* L, const char* data)
 		{
-			throw RuntimeError("Attempted to pairs '" + _Key->ToString() + "' (a " + GetTypeName() + " value)");
-			return {};
+			typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+			std::memcpy(&value, data, sizeof(T));
+			Extensions::AllowedType<T>::Push(L, *reinterpret_cast<T*>(&value));
 		}
-		std::vector<std::pair<Variable, Variable>> ret;
 		
-		this->Push();
+		class Encoder
 		{
-			lua_pushnil(*_State);
-			/* tbl=-2, key=-1 */
-			while (lua_next(*_State, -2) != 0)
-			{
-				/* tbl=-3 key=-2, value=-1 */
-				lua_pushvalue(*_State, -2);
-				/* tbl=-4 key=-3, value=-2, key=-1 */
-				Variable key = Variable::FromStack(_State);
-				/* tbl=-3 key=-2, value=-1 */
-				Variable val = Variable::FromStack(_State);
-				/* tbl=-2, key=-1 */
+			lua_State* L;
+			string& _Out;
+			int _Seen; // table -> id
+			lua_Integer _Tables;
+			int _Depth;
+			
+			void WriteVarint(uint64_t value)
+			{
+				char bytes[10];
+				size_t n = 0;
+				while(value >= 0x80)
+				{
+					bytes[n++] = static_cast<char>(value | 0x80);
+					value >>= 7;
+				}
+				bytes[n++] = static_cast<char>(value);
+				_Out.append(bytes, n);
+			}
+			
+			void WriteTag(Tag tag)
+			{
+				_Out.push_back(static_cast<char>(tag));
+			}
+		public:
+			Encoder(lua_State* L, string& out, int seen) : L(L), _Out(out), _Seen(seen), _Tables(0), _Depth(0)
+			{
+			}
+			
+			void Write(int index)
+			{
+				switch(lua_type(L, index))
+				{
+				case LUA_TNIL:
+					WriteTag(Nil);
+					break;
+				case LUA_TBOOLEAN:
+					WriteTag(lua_toboolean(L, index) ? True : False);
+					break;
+				case LUA_TNUMBER:
+				{
+#if LUA_VERSION_NUM >= 503
+					if(lua_isinteger(L, index))
+					{
+						uint64_t value = static_cast<uint64_t>(lua_tointeger(L, index));
+						WriteTag(Integer);
+						WriteVarint((value << 1) ^ (0 - (value >> 63))); // zigzag, so small negatives stay short
+						break;
+					}
+#endif
+					lua_Number value = lua_tonumber(L, index);
+					WriteTag(Float);
+					_Out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+					break;
+				}
+				case LUA_TSTRING:
+				{
+					size_t len;
+					const char* str = lua_tolstring(L, index, &len);
+					WriteTag(String);
+					WriteVarint(len);
+					_Out.append(str, len);
+					break;
+				}
+				case LUA_TTABLE:
+					WriteTable(lua_absindex(L, index));
+					break;
+				case LUA_TUSERDATA:
+				{
+					Extensions::ObjectHeader* header = static_cast<Extensions::ObjectHeader*>(lua_touserdata(L, index));
+					auto it = lua_rawlen(L, index) >= sizeof(Extensions::ObjectHeader) ? ByTag().find(header->Tag) : ByTag().end();
+					if(it == ByTag().end())
+						throw RuntimeError("Can not serialize a userdata of an unregistered type");
+					WriteTag(UserData);
+					WriteVarint(it->second.Name.size());
+					_Out.append(it->second.Name);
+					_Out.append(static_cast<const char*>(header->Pointer), it->second.Size);
+					break;
+				}
+				default:
+					throw RuntimeError(string("Can not serialize a ") + luaL_typename(L, index) + " value");
+				}
+			}
+			
+			void WriteTable(int index)
+			{
+				lua_pushvalue(L, index);
+				lua_rawget(L, _Seen);
+				if(!lua_isnil(L, -1))
+				{
+					WriteTag(Reference);
+					WriteVarint(static_cast<uint64_t>(lua_tointeger(L, -1)));
+					lua_pop(L, 1);
+					return;
+				}
+				lua_pop(L, 1);
+				
+				if(_Depth >= MaxDepth || !lua_checkstack(L, 4))
+					throw RuntimeError("Can not serialize tables nested more than " + std::to_string(MaxDepth) + " deep");
+				_Depth++;
+				
+				lua_pushvalue(L, index);
+				lua_pushinteger(L, ++_Tables);
+				lua_rawset(L, _Seen);
+				
+				// the length of the array part and a fixed width count of the rest, filled in once they
+				// have been written, so the decoder can size the table up front
+				size_t count = lua_rawlen(L, index);
+				WriteTag(Table);
+				WriteVarint(count);
+				size_t at = _Out.size();
+				_Out.append(sizeof(uint32_t), '\0');
+				for(size_t i = 1; i <= count; i++)
+				{
+					lua_rawgeti(L, index, static_cast<lua_Integer>(i));
+					Write(-1);
+					lua_pop(L, 1);
+				}
+				
+				uint32_t pairs = 0;
+				lua_pushnil(L);
+				while(lua_next(L, index))
+				{
+					if(lua_type(L, -2) == LUA_TNUMBER)
+					{
+						lua_Number key = lua_tonumber(L, -2);
+						if(key >= 1 && key <= static_cast<lua_Number>(count) && key == static_cast<lua_Number>(static_cast<size_t>(key)))
+						{
+							lua_pop(L, 1);
+							continue;
+						}
+					}
+					Write(-2);
+					Write(-1);
+					lua_pop(L, 1);
+					pairs++;
+				}
+				std::memcpy(&_Out[at], &pairs, sizeof(pairs));
+				_Depth--;
+			}
+		};
+		
+		class Decoder
+		{
+			lua_State* L;
+			const char* _Pos;
+			const char* _End;
+			int _Tables; // id -> table
+			lua_Integer _Count;
+			int _Depth;
+			
+			void Need(size_t bytes)
+			{
+				if(static_cast<size_t>(_End - _Pos) < bytes)
+					throw RuntimeError("Serialized data is truncated");
+			}
+			
+			uint64_t ReadVarint()
+			{
+				uint64_t value = 0;
+				for(int shift = 0; shift < 64; shift += 7)
+				{
+					Need(1);
+					unsigned char byte = static_cast<unsigned char>(*_Pos++);
+					value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+					if(!(byte & 0x80))
+						return value;
+				}
+				throw RuntimeError("Serialized data has a malformed integer");
+			}
+			
+			size_t ReadSize()
+			{
+				uint64_t size = ReadVarint();
+				if(size > static_cast<uint64_t>(_End - _Pos))
+					throw RuntimeError("Serialized data is truncated");
+				return static_cast<size_t>(size);
+			}
+		public:
+			Decoder(lua_State* L, const char* data, size_t size, int tables) : L(L), _Pos(data), _End(data + size), _Tables(tables), _Count(0), _Depth(0)
+			{
+			}
+			
+			bool Done() const
+			{
+				return _Pos == _End;
+			}
+			
+			// pushes the next value
+			void Read()
+			{
+				if(!lua_checkstack(L, 4))
+					throw RuntimeError("Serialized data is nested too deeply");
+				
+				Need(1);
+				switch(static_cast<unsigned char>(*_Pos++))
+				{
+				case Nil:
+					lua_pushnil(L);
+					break;
+				case False:
+					lua_pushboolean(L, 0);
+					break;
+				case True:
+					lua_pushboolean(L, 1);
+					break;
+				case Integer:
+				{
+					uint64_t value = ReadVarint();
+					lua_pushinteger(L, static_cast<lua_Integer>((value >> 1) ^ (0 - (value & 1))));
+					break;
+				}
+				case Float:
+				{
+					lua_Number value;
+					Need(sizeof(value));
+					std::memcpy(&value, _Pos, sizeof(value));
+					_Pos += sizeof(value);
+					lua_pushnumber(L, value);
+					break;
+				}
+				case String:
+				{
+					size_t len = ReadSize();
+					lua_pushlstring(L, _Pos, len);
+					_Pos += len;
+					break;
+				}
+				case Table:
+					ReadTable();
+					break;
+				case Reference:
+				{
+					uint64_t id = ReadVarint();
+					if(id == 0 || id > static_cast<uint64_t>(_Count))
+						throw RuntimeError("Serialized data refers to a table that is not there");
+					lua_rawgeti(L, _Tables, static_cast<lua_Integer>(id));
+					break;
+				}
+				case UserData:
+				{
+					size_t len = ReadSize();
+					auto it = ByName().find(string(_Pos, len));
+					if(it == ByName().end())
+						throw RuntimeError("Serialized data holds an unregistered type " + string(_Pos, len));
+					_Pos += len;
+					Need(it->second->Size);
+					it->second->Push(L, _Pos);
+					_Pos += it->second->Size;
+					break;
+				}
+				default:
+					throw RuntimeError("Serialized data is malformed");
+				}
+			}
+			
+			void ReadTable()
+			{
+				if(++_Depth > MaxDepth)
+					throw RuntimeError("Serialized data has tables nested more than " + std::to_string(MaxDepth) + " deep");
+				
+				size_t count = ReadSize(); // every element takes at least a byte
+				uint32_t pairs;
+				Need(sizeof(pairs));
+				std::memcpy(&pairs, _Pos, sizeof(pairs));
+				_Pos += sizeof(pairs);
+				if(pairs > static_cast<size_t>(_End - _Pos) / 2)
+					throw RuntimeError("Serialized data is truncated");
+				
+				lua_createtable(L, static_cast<int>(count), static_cast<int>(pairs));
+				int table = lua_gettop(L);
+				lua_pushvalue(L, table);
+				lua_rawseti(L, _Tables, ++_Count);
+				
+				for(size_t i = 1; i <= count; i++)
+				{
+					Read();
+					lua_rawseti(L, table, static_cast<lua_Integer>(i));
+				}
 				
-				ret.push_back({key, val});
+				for(uint32_t i = 0; i < pairs; i++)
+				{
+					Read();
+					if(lua_isnil(L, -1))
+						throw RuntimeError("Serialized data has a nil key");
+					if(lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) != lua_tonumber(L, -1))
+						throw RuntimeError("Serialized data has a NaN key");
+					Read();
+					lua_rawset(L, table);
+				}
+				_Depth--;
 			}
+		};
+		
+		struct Input
+		{
+			const char* Data;
+			size_t Size;
+		};
+		
+		// both run under lua_pcall, so a memory error from Lua is an exception like any other failure
+		static int EncodeValue(lua_State* L)
+		{
+			string* out = static_cast<string*>(lua_touserdata(L, 1));
+			lua_newtable(L);
+			Encoder(L, *out, 3).Write(2);
+			return 0;
 		}
-		lua_pop(*_State, 1);
 		
-		return ret;
-	}
+		static int DecodeValue(lua_State* L)
+		{
+			Input* input = static_cast<Input*>(lua_touserdata(L, 1));
+			lua_newtable(L);
+			Decoder decoder(L, input->Data, input->Size, 2);
+			decoder.Read();
+			if(!decoder.Done())
+				throw RuntimeError("Serialized data has trailing bytes");
+			return 1;
+		}
+		
+		static void Raise(lua_State* L)
+		{
+			const char* msg = lua_tostring(L, -1);
+			string err = msg ? msg : "Serialization failed";
+			lua_pop(L, 1);
+			throw RuntimeError(err);
+		}
+	public:
+		// how deeply tables may nest, as each level is a C++ call on both sides
+		static const int MaxDepth = 200;
+		
+		// lets value userdata of T be serialized, written as its bytes under the name; the name must be the
+		// same wherever the data is decoded, and T must be registered with the same name there
+		template<typename T>
+		static void Register(const string& name)
+		{
+			static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types are serialized as bytes");
+			Entry& entry = ByTag()[Extensions::ObjectTag<T>()];
+			entry.Name = name;
+			entry.Size = sizeof(T);
+			entry.Push = &PushObject<T>;
+			ByName()[name] = &entry;
+		}
+		
+		// appends the value at index to out, leaving out as it was if the value can't be encoded
+		static void Encode(lua_State* L, int index, string& out)
+		{
+			size_t size = out.size();
+			index = lua_absindex(L, index);
+			lua_pushcfunction(L, &CppFunction::Protected<&EncodeValue>);
+			lua_pushlightuserdata(L, &out);
+			lua_pushvalue(L, index);
+			if(lua_pcall(L, 2, 0, 0))
+			{
+				out.resize(size);
+				Raise(L);
+			}
+		}
+		
+		// pushes the value held in data
+		static void Decode(lua_State* L, const char* data, size_t size)
+		{
+			Input input = { data, size };
+			lua_pushcfunction(L, &CppFunction::Protected<&DecodeValue>);
+			lua_pushlightuserdata(L, &input);
+			if(lua_pcall(L, 1, 1, 0))
+				Raise(L);
+		}
+		
+		static string Encode(const Variable& value)
+		{
+			string out;
+			value.Push();
+			try
+			{
+				Encode(*value._State, -1, out);
+			}
+			catch(...)
+			{
+				lua_pop(*value._State, 1);
+				throw;
+			}
+			lua_pop(*value._State, 1);
+			return out;
+		}
+		
+		static Variable Decode(State* state, const string& data)
+		{
+			Decode(*state, data.data(), data.size());
+			return Variable::FromStack(state);
+		}
+	};
 	
-	inline std::vector<std::pair<Variable, Variable>> Variable::ipairs()
+	// states that have already been set up (standard library, prelude scripts), leased out one at a time
+	// and put back to how setup left them. the reset is shallow, one level down: the globals, every table
+	// that was a global or in package.loaded after setup (the libraries, modules, setup's own tables) and
+	// package.loaded itself get their fields back, and the globals their metatable. changes any deeper,
+	// to tables made during the lease, or to the rest of the registry carry over to the next lease, so it
+	// is not an isolation boundary.
+	// Acquire and the release of a Lease only swap pointers in a fixed array of slots; a state is only
+	// made, outside the pool, when every slot is empty, and one released into a full pool is destroyed
+	class StatePool
 	{
-		if(GetType() != Type::Table)
+		std::function<void(State&)> _Setup;
+		std::unique_ptr<std::atomic<State*>[]> _Slots;
+		size_t _Capacity;
+		std::atomic<size_t> _Next; // where the next scan starts, so threads spread over the slots
+		std::atomic<size_t> _Created;
+		
+		mutable std::mutex _AbandonedLock;
+		std::vector<State*> _Abandoned; // kept until the pool goes, as handles into them are still alive
+		
+		// table -> its shallow copy, for every table the reset puts back
+		static const void* BaselineKey()
+		{
+			static const char key = 0;
+			return &key;
+		}
+		
+		static const void* MetatableKey()
 		{
-			throw RuntimeError("Attempted to ipairs '" + _Key->ToString() + "' (a " + GetTypeName() + " value)");
-			return {};
+			static const char key = 0;
+			return &key;
 		}
 		
-		int i = 1;
-		Variable& self = *this;
-		std::vector<std::pair<Variable, Variable>> ret;
+		static const void* ReferencesKey()
+		{
+			static const char key = 0;
+			return &key;
+		}
 		
-		while(true)
+		// adds a shallow copy of the table at index to the baseline at index baseline, once per table
+		static void Track(lua_State* L, int baseline, int index)
 		{
-			Variable var = self[i];
-			
-			if(var.IsNil())
-				break;
+			index = lua_absindex(L, index);
+			lua_pushvalue(L, index);
+			lua_rawget(L, baseline);
+			bool tracked = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+			if(tracked)
+				return;
 			
-			ret.push_back({Variable(_State, i), var});
-			i++;
+			lua_pushvalue(L, index);
+			lua_newtable(L);
+			lua_pushnil(L);
+			while(lua_next(L, index))
+			{
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, -4);
+			}
+			lua_rawset(L, baseline);
 		}
 		
-		return ret;
-	}
-	
-	inline void Variable::Push() const
-	{
-		switch(_Type)
+		// tracks every table among the fields of the one at index
+		static void TrackFields(lua_State* L, int baseline, int index)
 		{
-		case Type::Nil:
-			lua_pushnil(*_State);
-			break;
-		case Type::String:
-			lua_pushstring(*_State, String.c_str());
-			break;
-		case Type::Number:
-			lua_pushnumber(*_State, Data.Real);
-			break;
-		case Type::Boolean:
-			lua_pushboolean(*_State, Data.Boolean);
-			break;
-		case Type::LightUserData:
-			lua_pushlightuserdata(*_State, Data.Pointer);
-			break;
-		case Type::Function:
-		case Type::Table:
-		case Type::UserData:
-			Ref->Push();
-			break;
-		default:
-			throw RuntimeError("The type `" + GetTypeName() + "' hasn't been implimented!");
+			index = lua_absindex(L, index);
+			lua_pushnil(L);
+			while(lua_next(L, index))
+			{
+				if(lua_type(L, -1) == LUA_TTABLE)
+					Track(L, baseline, -1);
+				lua_pop(L, 1);
+			}
 		}
-	}
-	
-	inline Type Variable::GetType() const
-	{
-		return _Type;
-	}
-	
-	inline string Variable::GetTypeName() const
-	{
-		return lua_typename(*_State, _Type);
-	}
-	
-	template<typename T>
-	typename Variable::AsType<T>::type Variable::As()
-	{
-		return Extensions::AllowedType<T>::GetFromVar(*this);
-	}
-	
-	template<typename T>
-	bool Variable::Is() const
-	{
-		return Extensions::AllowedType<T>::CheckVar(*this);
-	}
-	
-	namespace Extensions
-	{
-		template <typename T>
-		struct AllowedType
+		
+		// puts the fields of the table at index back to those of its copy
+		static void Restore(lua_State* L, int index, int copy)
 		{
-			static T& GetFromVar(const Variable& var)
+			index = lua_absindex(L, index);
+			copy = lua_absindex(L, copy);
+			
+			// clear what was added; existing fields may be cleared while traversing
+			lua_pushnil(L);
+			while(lua_next(L, index))
 			{
-				if (var.GetType() == Type::UserData)
+				lua_pop(L, 1);
+				lua_pushvalue(L, -1);
+				lua_rawget(L, copy);
+				bool added = lua_isnil(L, -1);
+				lua_pop(L, 1);
+				if(added)
 				{
-					var.Push();
-					T* ret = static_cast<T*>(lua_touserdata(*var._State, -1));
-					lua_pop(*var._State, 1);
-					return *ret;
+					lua_pushvalue(L, -1);
+					lua_pushnil(L);
+					lua_rawset(L, index);
 				}
-				throw RuntimeError(string("Can not convert Variable to ") + typeid(T).name() + ".");
 			}
-			static void Push(lua_State* L, const T& value)
+			
+			// and put back what was changed or removed
+			lua_pushnil(L);
+			while(lua_next(L, copy))
 			{
-				T* ud = static_cast<T*>(lua_newuserdata(L, sizeof(T)));
-				new(ud) T(value);
-
-				lua_newtable(L);
-				lua_pushstring(L, "__gc");
-				lua_pushcfunction(L, [](lua_State* L) {
-					T* p = static_cast<T*>(lua_touserdata(L, -1));
-					p->~T();
-					return 0;
-				});
-				lua_settable(L, -3);
-				lua_setmetatable(L, -2);
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, index);
 			}
-
-			static T& GetParameter(lua_State* L, int count)
+		}
+		
+		State* Create()
+		{
+			std::unique_ptr<State> state(new State());
+			if(_Setup)
+				_Setup(*state);
+			
+			lua_State* L = *state;
+			lua_settop(L, 0);
+			lua_newtable(L);
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			Track(L, 1, 2);
+			TrackFields(L, 1, 2);
+			lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED"); // package.loaded, when the package library is open
+			if(lua_type(L, 3) == LUA_TTABLE)
 			{
-				return *static_cast<T*>(lua_touserdata(L, count));
+				Track(L, 1, 3);
+				TrackFields(L, 1, 3);
 			}
-		};
-		template <>
-		struct AllowedType<int>
+			lua_pop(L, 1);
+			
+			if(!lua_getmetatable(L, 2))
+				lua_pushnil(L);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, MetatableKey());
+			lua_pop(L, 1);
+			lua_rawsetp(L, LUA_REGISTRYINDEX, BaselineKey());
+			
+			// the references setup left held, any more on release outlived their lease
+			lua_pushinteger(L, static_cast<lua_Integer>(state->GetLiveReferences()));
+			lua_rawsetp(L, LUA_REGISTRYINDEX, ReferencesKey());
+			
+			state->CollectReferences();
+			lua_gc(L, LUA_GCCOLLECT, 0);
+			_Created++;
+			return state.release();
+		}
+		
+		// false if handles from the lease still hold references, then the state can't be reused
+		static bool Reset(State& state)
 		{
-			static int GetFromVar(const Variable& var)
+			lua_State* L = state;
+			lua_settop(L, 0);
+			lua_rawgetp(L, LUA_REGISTRYINDEX, ReferencesKey());
+			size_t baseline = static_cast<size_t>(lua_tointeger(L, -1));
+			lua_pop(L, 1);
+			if(state.GetLiveReferences() > baseline)
+				return false;
+			
+			lua_rawgetp(L, LUA_REGISTRYINDEX, BaselineKey());
+			lua_pushnil(L);
+			while(lua_next(L, 1))
 			{
-				if (var.GetType() == Type::Number)
-				{
-					return static_cast<int>(var.Data.Real);
-				}
-				return 0;
+				Restore(L, -2, -1);
+				lua_pop(L, 1);
 			}
-			static bool CheckVar(const Variable& var)
+			
+			lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+			lua_rawgetp(L, LUA_REGISTRYINDEX, MetatableKey());
+			lua_setmetatable(L, -2);
+			lua_settop(L, 0);
+			
+			state.CollectReferences();
+			lua_gc(L, LUA_GCCOLLECT, 0);
+			return true;
+		}
+	public:
+		// owns the State it was given until it is destroyed or moved from, then gives it back to the pool
+		class Lease
+		{
+			StatePool* _Pool;
+			State* _State;
+		public:
+			Lease(StatePool* pool, State* state) : _Pool(pool), _State(state)
 			{
-				return var.GetType() == Type::Number;
 			}
-			static int GetParameter(lua_State* L, int count)
+			
+			Lease(Lease&& other) : _Pool(other._Pool), _State(other._State)
 			{
-				return lua_tointeger(L, count);
+				other._State = nullptr;
 			}
-			static void Push(lua_State* L, int value)
+			
+			Lease(const Lease&) = delete;
+			Lease& operator=(const Lease&) = delete;
+			
+			~Lease()
 			{
-				lua_pushinteger(L, value);
+				if(_State)
+					_Pool->Release(_State);
 			}
-		};
-
-		template <>
-		struct AllowedType<bool>
-		{
-			static bool GetFromVar(const Variable& var)
+			
+			State& operator*() const
 			{
-				if (var.GetType() == Type::Boolean)
-				{
-					return var.Data.Boolean;
-				}
-				return false;
+				return *_State;
 			}
-			static bool CheckVar(const Variable& var)
+			
+			State* operator->() const
 			{
-				return var.GetType() == Type::Boolean;
+				return _State;
 			}
-			static int GetParameter(lua_State* L, int count)
+			
+			State* Get() const
 			{
-				return lua_toboolean(L, count);
+				return _State;
 			}
-			static void Push(lua_State* L, bool value)
+		};
+		
+		// fills every slot up front; setup runs once per state, and whatever globals it leaves are the baseline
+		StatePool(size_t capacity, std::function<void(State&)> setup = nullptr)
+			: _Setup(std::move(setup)), _Slots(new std::atomic<State*>[capacity]), _Capacity(capacity), _Next(0), _Created(0)
+		{
+			size_t filled = 0;
+			try
 			{
-				lua_pushboolean(L, value);
+				for(; filled < _Capacity; filled++)
+					_Slots[filled].store(Create(), std::memory_order_relaxed);
 			}
-		};
-		template <size_t LEN>
-		struct AllowedType<const char[LEN]>
+			catch(...)
+			{
+				for(size_t i = 0; i < filled; i++)
+					delete _Slots[i].load(std::memory_order_relaxed);
+				throw;
+			}
+		}
+		
+		StatePool(const StatePool&) = delete;
+		StatePool& operator=(const StatePool&) = delete;
+		
+		// every Lease must have been released first, and every handle into an abandoned state let go
+		~StatePool()
 		{
-			static bool CheckVar(const Variable& var)
+			for(size_t i = 0; i < _Capacity; i++)
+				delete _Slots[i].load(std::memory_order_relaxed);
+			for(State* state : _Abandoned)
+				delete state;
+		}
+		
+		Lease Acquire()
+		{
+			size_t start = _Next.fetch_add(1, std::memory_order_relaxed);
+			for(size_t i = 0; i < _Capacity; i++)
 			{
-				return var.GetType() == Type::String;
+				std::atomic<State*>& slot = _Slots[(start + i) % _Capacity];
+				if(slot.load(std::memory_order_relaxed) == nullptr)
+					continue;
+				if(State* state = slot.exchange(nullptr, std::memory_order_acquire))
+					return Lease(this, state);
 			}
-			static const char* GetParameter(lua_State* L, int count)
+			return Lease(this, Create());
+		}
+		
+		// resets the state's globals and collects its garbage. Variables, FunctionHandle<> and Global<> handles
+		// made during the lease must be gone by now; if any are still alive the state is abandoned, neither
+		// reused, which would show the next tenant what they hold, nor destroyed, which would leave them
+		// dangling. the pool keeps it, counted in GetAbandoned(), and destroys it along with the rest
+		void Release(State* state)
+		{
+			if(!Reset(*state))
 			{
-				return lua_tostring(L, count);
+				std::lock_guard<std::mutex> lock(_AbandonedLock);
+				_Abandoned.push_back(state);
+				return;
 			}
-			static void Push(lua_State* L, const char* value)
+			
+			size_t start = _Next.load(std::memory_order_relaxed);
+			for(size_t i = 0; i < _Capacity; i++)
 			{
-				lua_pushstring(L, value);
+				std::atomic<State*>& slot = _Slots[(start + i) % _Capacity];
+				State* expected = nullptr;
+				if(slot.compare_exchange_strong(expected, state, std::memory_order_release, std::memory_order_relaxed))
+					return;
 			}
+			delete state;
+		}
+		
+		size_t GetCapacity() const
+		{
+			return _Capacity;
+		}
+		
+		// how many states have been made and set up, including those made because the pool ran dry
+		size_t GetCreated() const
+		{
+			return _Created.load(std::memory_order_relaxed);
+		}
+		
+		// states released while handles from their lease were still alive
+		size_t GetAbandoned() const
+		{
+			std::lock_guard<std::mutex> lock(_AbandonedLock);
+			return _Abandoned.size();
+		}
+	};
+	
+	// worker threads, each with a State of its own that setup fills in, running jobs handed in from any
+	// thread. every worker has a deque of jobs: it takes its newest one first, and when it runs out steals
+	// the oldest one from another worker, so an uneven batch still keeps every core busy.
+	// a worker's State is not reset between jobs: globals a job sets are seen by later jobs on the same
+	// worker, so jobs that need a clean state should use locals or lease one from a StatePool.
+	// a job may submit more jobs and wait for them with Wait(), which runs queued jobs on the waiting
+	// worker meanwhile; calling get() or wait() on the future directly from a job can deadlock, as the
+	// new job goes on the waiting worker's own deque
+	class Executor
+	{
+		// how an argument to Call is kept until a worker gets to it: C strings are copied, as the
+		// caller's buffer may be gone by then
+		template<typename T>
+		struct Stored
+		{
+			typedef typename std::decay<T>::type type;
+		};
+		template<typename T>
+		struct Stored<T*>
+		{
+			typedef typename std::conditional<std::is_same<typename std::remove_cv<T>::type, char>::value, string, T*>::type type;
 		};
 		
-		template <size_t LEN>
-		struct AllowedType<char[LEN]> : public AllowedType<const char[LEN]>
-		{};
-
-		template <>
-		struct AllowedType<const char*>
+		typedef std::function<void(State&)> Job;
+		
+		struct Worker
+		{
+			std::mutex Lock;
+			std::deque<Job> Jobs;
+			std::unique_ptr<State> LuaState;
+			std::thread Thread;
+		};
+		
+		std::vector<std::unique_ptr<Worker>> _Workers;
+		std::atomic<size_t> _Next; // the worker a job from outside goes to, round robin
+		std::atomic<size_t> _Pending; // queued and not yet taken
+		std::mutex _SleepLock;
+		std::condition_variable _Wake;
+		bool _Stopping;
+		
+		// the worker running on this thread, so jobs that submit jobs keep them local
+		static Worker*& CurrentWorker()
+		{
+			static thread_local Worker* worker = nullptr;
+			return worker;
+		}
+		
+		bool Take(Worker& worker, Job& job)
 		{
-			static const char* GetFromVar(const Variable& var)
 			{
-				if (var.GetType() == Type::String)
+				std::lock_guard<std::mutex> guard(worker.Lock);
+				if(!worker.Jobs.empty())
 				{
-					return var.String.c_str();
+					job = std::move(worker.Jobs.back());
+					worker.Jobs.pop_back();
+					_Pending--;
+					return true;
 				}
-				return nullptr;
 			}
-		};
-
-		template <>
-		struct AllowedType<string>
+			
+			for(const std::unique_ptr<Worker>& victim : _Workers)
+			{
+				if(victim.get() == &worker)
+					continue;
+				std::lock_guard<std::mutex> guard(victim->Lock);
+				if(!victim->Jobs.empty())
+				{
+					job = std::move(victim->Jobs.front());
+					victim->Jobs.pop_front();
+					_Pending--;
+					return true;
+				}
+			}
+			return false;
+		}
+		
+		void Run(Worker& worker)
 		{
-			static string GetFromVar(const Variable& var)
+			CurrentWorker() = &worker;
+			Job job;
+			for(;;)
 			{
-				if (var.GetType() == Type::String)
+				if(Take(worker, job))
 				{
-					return var.String;
+					job(*worker.LuaState);
+					job = nullptr;
+					continue;
 				}
-				return string();
+				
+				std::unique_lock<std::mutex> lock(_SleepLock);
+				if(_Stopping && _Pending == 0)
+					return;
+				_Wake.wait(lock, [this]() { return _Stopping || _Pending != 0; });
 			}
-			static bool CheckVar(const Variable& var)
+		}
+		
+		// the worker on this thread if it belongs to this executor, otherwise null
+		Worker* LocalWorker()
+		{
+			Worker* worker = CurrentWorker();
+			for(const std::unique_ptr<Worker>& w : _Workers)
+				if(w.get() == worker)
+					return worker;
+			return nullptr;
+		}
+		
+		void Enqueue(Job job)
+		{
+			Worker* worker = LocalWorker();
+			if(!worker)
+				worker = _Workers[_Next.fetch_add(1, std::memory_order_relaxed) % _Workers.size()].get();
+			
 			{
-				return var.GetType() == Type::String;
+				std::lock_guard<std::mutex> guard(worker->Lock);
+				worker->Jobs.push_back(std::move(job));
+				_Pending++;
 			}
-			static string GetParameter(lua_State* L, int count)
+			// taking the lock orders this with a worker deciding to sleep, so the wake up can not be missed
+			std::lock_guard<std::mutex> guard(_SleepLock);
+			_Wake.notify_one();
+		}
+	public:
+		// setup runs once for each worker's State, on the calling thread, before any worker starts
+		Executor(size_t workers, std::function<void(State&)> setup = nullptr) : _Next(0), _Pending(0), _Stopping(false)
+		{
+			if(workers == 0)
+				workers = 1;
+			for(size_t i = 0; i < workers; i++)
 			{
-				return lua_tostring(L, count);
+				std::unique_ptr<Worker> worker(new Worker());
+				worker->LuaState.reset(new State());
+				if(setup)
+					setup(*worker->LuaState);
+				_Workers.push_back(std::move(worker));
 			}
-			static void Push(lua_State* L, const string& value)
+			for(const std::unique_ptr<Worker>& worker : _Workers)
 			{
-				lua_pushstring(L, value.c_str());
+				Worker* w = worker.get();
+				w->Thread = std::thread([this, w]() { Run(*w); });
 			}
-		};
-
-		template <typename T>
-		struct AllowedType<T*>
+		}
+		
+		Executor(const Executor&) = delete;
+		Executor& operator=(const Executor&) = delete;
+		
+		// runs every job already submitted, then joins the workers
+		~Executor()
 		{
-			static T* GetFromVar(const Variable& var)
 			{
-				if (var.GetType() == Type::LightUserData || var.GetType() == Type::UserData)
-				{
-					var.Ref->Push();
-					T* ret = lua_touserdata(*var._State, -1);
-					lua_pop(*var._State, 1);
-					return ret;
-				}
-				return nullptr;
+				std::lock_guard<std::mutex> guard(_SleepLock);
+				_Stopping = true;
 			}
-			static bool CheckVar(const Variable& var)
+			_Wake.notify_all();
+			for(const std::unique_ptr<Worker>& worker : _Workers)
+				worker->Thread.join();
+		}
+		
+		size_t GetWorkers() const
+		{
+			return _Workers.size();
+		}
+		
+		// runs func(state) on whichever worker gets to it; the future holds the result or what func threw.
+		// anything func captures by reference or pointer must outlive the job
+		template<typename Func, typename R = decltype(std::declval<Func&>()(std::declval<State&>()))>
+		std::future<R> Submit(Func func)
+		{
+			std::shared_ptr<std::packaged_task<R(State&)>> task = std::make_shared<std::packaged_task<R(State&)>>(std::move(func));
+			std::future<R> ret = task->get_future();
+			Enqueue([task](State& state) { (*task)(state); });
+			return ret;
+		}
+		
+		// blocks until the future is ready. from one of this executor's jobs the worker keeps running queued
+		// jobs, nested ones on its own State, until it is, so a job can wait on jobs it submitted
+		template<typename Future>
+		void Wait(const Future& future)
+		{
+			Worker* worker = LocalWorker();
+			if(!worker)
 			{
-				return var.GetType() == Type::LightUserData || var.GetType() == Type::UserData;
+				future.wait();
+				return;
 			}
-			static T* GetParameter(lua_State* L, int count)
+			
+			Job job;
+			while(future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
 			{
-				return lua_touserdata(L, count);
+				if(Take(*worker, job))
+				{
+					job(*worker->LuaState);
+					job = nullptr;
+				}
+				else // being woken by the result, or checking for new jobs every so often
+					future.wait_for(std::chrono::milliseconds(1));
 			}
-			static void Push(lua_State* L, T* value)
+		}
+		
+		// calls the global function with the arguments, reading R (void, a value or a std::tuple) back
+		template<typename R = void, typename... Args>
+		std::future<R> Call(const string& function, Args&&... args)
+		{
+			typedef FunctionHandle<R(typename Stored<typename std::decay<Args>::type>::type...)> Signature;
+			std::tuple<typename Stored<typename std::decay<Args>::type>::type...> params(std::forward<Args>(args)...);
+			return Submit([function, params](State& state) -> R
 			{
-				lua_pushlightuserdata(L, value);
-			}
-		};
-	}
+				return Apply(Signature(state[function]), params, typename CppFunction::gens<sizeof...(Args)>::type());
+			});
+		}
+	private:
+		template<typename Func, typename Tuple, int... N>
+		static auto Apply(const Func& func, const Tuple& params, CppFunction::seq<N...>) -> decltype(func(std::get<N>(params)...))
+		{
+			return func(std::get<N>(params)...);
+		}
+	};
 }
 
 #endif
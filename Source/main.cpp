@@ -1,5 +1,9 @@
 // STL
 #include <iostream>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <cstdio>
 
 // Lua
 #include "Lua++.hpp"
@@ -138,6 +142,1231 @@ bool test_cppfunction()
 	return true;
 }
 
+bool test_variable_layout()
+{
+	State state;
+	CHECK_STACK;
+	
+	string long_str(100, 'x');
+	
+	Variable short_var(&state, "short");
+	Variable long_var(&state, long_str);
+	check(short_var.As<string>() == "short");
+	check(long_var.As<string>() == long_str);
+	
+	Variable copy = long_var;
+	check(copy.GetStringData() == long_var.GetStringData()); // shares the buffer
+	check(copy == long_var);
+	
+	Variable tbl(&state, Type::Table);
+	{
+		Variable alias = tbl;
+		alias["value"] = 42;
+	}
+	check(tbl["value"] == 42);
+	
+	check(sizeof(Variable) <= 48);
+	return true;
+}
+
+bool test_proxy()
+{
+	State state;
+	CHECK_STACK;
+	
+	state.DoString("config = { net = { port = 80 } } function config.net.double(x) return x * 2 end");
+	
+	check(state["config"]["net"]["port"] == 80);
+	state["config"]["net"]["port"] = 5;
+	check(state["config"]["net"]["port"].As<int>() == 5);
+	check(state["config"]["net"]["double"](21).First() == 42);
+	check(state["config"]["missing"].IsNil());
+	
+	state["config"]["net"]["host"] = state["config"]["net"]["port"];
+	check(state["config"]["net"]["host"] == 5);
+	
+	// once stored, a Variable remembers where it came from
+	Variable port = state["config"]["net"]["port"];
+	port = 6;
+	check(state["config"]["net"]["port"] == 6);
+	
+	try
+	{
+		state["config"]["missing"]["value"] = 1;
+		return false;
+	}
+	catch(Lua::RuntimeError& ex)
+	{
+	}
+	
+	return true;
+}
+
+bool test_reference_pool()
+{
+	State state;
+	CHECK_STACK;
+	
+	size_t live = state.GetLiveReferences();
+	{
+		std::vector<Variable> tables;
+		for(int i = 0; i < 1000; i++)
+			tables.push_back(Variable(&state, Type::Table));
+		
+		check(state.GetLiveReferences() == live + 1000);
+		check(state.GetPeakReferences() >= live + 1000);
+	}
+	check(state.GetLiveReferences() == live);
+	
+	// churn reuses the same slots, the registry doesn't grow
+	state.CollectReferences();
+	size_t registry_size = lua_rawlen(state, LUA_REGISTRYINDEX);
+	for(int i = 0; i < 10000; i++)
+	{
+		Variable tbl(&state, Type::Table);
+		tbl["value"] = i;
+		check(tbl["value"] == i);
+	}
+	check(lua_rawlen(state, LUA_REGISTRYINDEX) == registry_size);
+	
+	return true;
+}
+
+bool test_stackref()
+{
+	struct Callbacks
+	{
+		static int sum(StackRef tbl, StackRange rest)
+		{
+			size_t live = tbl._State->GetLiveReferences();
+			
+			int ret = tbl["base"].As<int>();
+			for(StackRef arg : rest)
+			{
+				if(arg.Is<int>())
+					ret += arg.As<int>();
+				else if(arg.GetType() == Type::Function)
+					ret += arg(ret).First().As<int>();
+			}
+			
+			if(tbl._State->GetLiveReferences() != live)
+				return -1;
+			return ret;
+		}
+	};
+	
+	State state;
+	CHECK_STACK;
+	
+	state["sum"] = Variable::FromFunction(&state, &Callbacks::sum);
+	state.DoString("result = sum({ base = 10 }, 1, 2, function(x) return x end)");
+	check(state["result"] == 26);
+	
+	lua_pushinteger(state, 5);
+	{
+		StackRef ref(&state, -1);
+		check(ref.Is<int>() && !ref.Is<string>());
+		check(ref == 5);
+		check(ref.ToVariable() == 5);
+	}
+	lua_pop(state, 1);
+	
+	return true;
+}
+
+bool test_strings()
+{
+	State state;
+	CHECK_STACK;
+	
+	const char payload[] = "payload\0with\0nuls, long enough to be pinned";
+	string binary(payload, sizeof(payload) - 1);
+	state["binary"] = binary;
+	check(state["binary"].As<string>() == binary);
+	state.DoString("binary_len = #binary");
+	check(state["binary_len"] == static_cast<int>(binary.size()));
+	
+	// arrays push up to their terminator, not their whole size
+	const char name[32] = "abc";
+	Extensions::AllowedType<const char[32]>::Push(state, name);
+	check(lua_rawlen(state, -1) == 3);
+	lua_pop(state, 1);
+	char buffer[16] = "abc";
+	state["buffer"] = buffer;
+	check(state["buffer"].As<string>() == "abc");
+	
+	// long strings are read in place rather than copied
+	Variable var = state["binary"];
+	state["binary"].Push();
+	check(var.GetStringData() == lua_tostring(state, -1));
+	lua_pop(state, 1);
+	
+#if __cplusplus >= 201703L
+	check(var.As<std::string_view>() == std::string_view(binary));
+	state["view"] = std::string_view("a view");
+	check(state["view"] == "a view");
+#endif
+	
+	return true;
+}
+
+bool test_integers()
+{
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	int64_t big = (int64_t(1) << 53) + 1; // not representable as a double
+	state["id"] = big;
+	check(state["id"].As<int64_t>() == big);
+	
+	Variable id = state["id"];
+	check(id.As<int64_t>() == big);
+	check(id.ToString() == "9007199254740993");
+#if LUA_VERSION_NUM >= 503
+	check(id.IsInteger());
+	state.DoString("is_int = math.type(id) == 'integer'");
+	check(state["is_int"] == true);
+	
+	state["real"] = 2.0;
+	check(!Variable(state["real"]).IsInteger());
+#endif
+	
+	state["count"] = size_t(42);
+	state["mask"] = uint32_t(0xffffffff);
+	state["ratio"] = 0.5f;
+	check(state["count"].As<size_t>() == 42);
+	check(state["mask"].As<uint32_t>() == 0xffffffff);
+	check(state["ratio"].As<float>() == 0.5f);
+	check(Variable(state["ratio"]).As<double>() == 0.5);
+	
+	return true;
+}
+
+bool test_iteration()
+{
+	State state;
+	CHECK_STACK;
+	
+	state.DoString("list = {} for i = 1, 1000 do list[i] = i end list.name = 'list' holes = { 1, 2, nil, 4 }");
+	
+	lua_Integer sum = 0, count = 0;
+	for(auto kv : state["list"].ipairs())
+	{
+		check(kv.first == kv.second.As<lua_Integer>());
+		sum += kv.second.As<lua_Integer>();
+		count++;
+	}
+	check(count == 1000 && sum == 500500);
+	
+	count = 0;
+	for(auto kv : state["holes"].ipairs())
+		count += kv.second.IsNil() ? 0 : 1;
+	check(count == 2);
+	
+	count = 0;
+	bool found_name = false;
+	Variable list = state["list"];
+	for(auto kv : list.pairs())
+	{
+		// converting a number key must not break lua_next
+		if(kv.first.As<string>() == "name")
+			found_name = kv.second == "list";
+		count++;
+	}
+	check(count == 1001 && found_name);
+	
+	// leaving early still cleans up the stack
+	for(auto kv : list.pairs())
+		if(!kv.first.IsNil())
+			break;
+	for(auto kv : list.ipairs())
+		if(kv.first == 10)
+			break;
+	
+	return true;
+}
+
+bool test_arrays()
+{
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	std::vector<double> samples(10000);
+	for(size_t i = 0; i < samples.size(); i++)
+		samples[i] = i * 0.5;
+	
+	state["samples"] = samples;
+	state.DoString("total = 0 for i, v in ipairs(samples) do total = total + v end");
+	check(state["total"] == 24997500.0);
+	check(state["samples"].As<std::vector<double>>() == samples);
+	
+	typedef std::array<int, 3> Triple;
+	Triple triple = {{ 1, 2, 3 }};
+	state["triple"] = triple;
+	check(state["triple"].As<Triple>() == triple);
+	
+	typedef std::vector<std::vector<int>> Nested;
+	Nested nested = { { 1 }, { 2, 3 } };
+	state["nested"] = nested;
+	check(state["nested"][2][2] == 3);
+	check(state["nested"].As<Nested>() == nested);
+	
+	float buffer[4] = { 1.5f, 2.5f, 3.5f, 9 };
+	state["floats"] = Span<float>(buffer, 3);
+	check(state["floats"][3] == 3.5f);
+	
+	// into preallocated storage
+	state.DoString("floats = { 4, 5, 6 }");
+	check(Variable(state["floats"]).CopyTo(Span<float>(buffer)) == 3);
+	check(buffer[0] == 4 && buffer[2] == 6 && buffer[3] == 9);
+	
+	return true;
+}
+
+bool test_maps()
+{
+	State state;
+	CHECK_STACK;
+	
+	typedef std::map<string, std::unordered_map<string, int>> Config;
+	Config config;
+	config["net"]["port"] = 80;
+	config["net"]["timeout"] = 30;
+	config["limits"]["entities"] = 100000;
+	
+	state["config"] = config;
+	check(state["config"]["net"]["port"] == 80);
+	check(state["config"]["limits"]["entities"] == 100000);
+	check(state["config"].As<Config>() == config);
+	
+	// keys of the wrong type are skipped
+	state.DoString("mixed = { a = 1, b = 2, [10] = 3 }");
+	std::map<string, int> mixed = state["mixed"].As<std::map<string, int>>();
+	check(mixed.size() == 2 && mixed["b"] == 2);
+	
+	return true;
+}
+
+bool test_buffer()
+{
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	// owned by the userdata
+	Variable owned = Buffer<float>::New(&state, 1000);
+	Buffer<float>& frame = owned.As<Buffer<float>>();
+	check(frame.Size == 1000);
+	check(reinterpret_cast<uintptr_t>(frame.Data) % Buffer<float>::Alignment == 0);
+	for(size_t i = 0; i < frame.Size; i++)
+		frame[i] = 0.5f;
+	
+	state["frame"] = owned;
+	state.DoString("total = 0 for i = 1, #frame do total = total + frame[i] end frame[1] = 7");
+	check(state["total"] == 500);
+	check(frame[0] == 7);
+	check(state["frame"][1001].IsNil());
+	
+	// a view of C++ memory, writes go straight through
+	std::vector<int32_t> samples = { 1, 2, 3, 4, 5 };
+	state["samples"] = Buffer<int32_t>(samples);
+	state.DoString("part = samples:slice(2, 4) part[1] = 20 samples = nil collectgarbage()");
+	check(samples[1] == 20);
+	check(state["part"].As<Buffer<int32_t>>().Data == samples.data() + 1);
+	check(state["part"].Is<Buffer<int32_t>>() && !state["part"].Is<Buffer<float>>());
+	
+	state.DoString("ok = pcall(function() part[4] = 1 end) len = #part");
+	check(state["ok"] == false);
+	check(state["len"] == 3);
+	
+	return true;
+}
+
+bool test_typed_call()
+{
+	State state;
+	CHECK_STACK;
+	
+	state.DoString("function stats(a, b) return a + b, a / b, 'sum' end function nothing() end");
+	
+	std::tuple<int, double, string> ret = state["stats"].Call<int, double, string>(6, 4);
+	check(std::get<0>(ret) == 10 && std::get<1>(ret) == 1.5 && std::get<2>(ret) == "sum");
+	
+	// one result is returned bare, extra results are dropped and missing ones are nil
+	check(state["stats"].Call<int>(1, 2) == 3);
+	check(state["nothing"].Call<bool>() == false);
+	state["nothing"].Call<>();
+	
+	Variable stats = state["stats"];
+#if __cplusplus >= 201703L
+	auto [sum, ratio] = stats.Call<int, double>(3, 2);
+	check(sum == 5 && ratio == 1.5);
+#endif
+	
+	bool threw = false;
+	try
+	{
+		state["missing"].Call<int>();
+	}
+	catch(const RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	
+	return true;
+}
+
+bool test_function()
+{
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	state.DoString("ticks = 0 function tick(dt) ticks = ticks + dt end function add(a, b) return a + b end");
+	state.DoString("function divmod(a, b) return a // b, a % b end function fail() error('bad tick') end");
+	
+	FunctionHandle<void(int)> tick = state["tick"];
+	for(int i = 0; i < 100; i++)
+		tick(2);
+	check(state["ticks"] == 200);
+	
+	// still bound after the global goes
+	FunctionHandle<int(int, int)> add = state["add"];
+	state.DoString("add = nil");
+	check(add(40, 2) == 42);
+	
+	FunctionHandle<std::tuple<int, int>(int, int)> divmod = state["divmod"];
+	check(divmod(7, 2) == std::make_tuple(3, 1));
+	
+	FunctionHandle<void()> fail(state["fail"], state["debug"]["traceback"]);
+	string err;
+	try
+	{
+		fail();
+	}
+	catch(RuntimeError& ex)
+	{
+		err = ex.what();
+	}
+	check(err.find("bad tick") != string::npos && err.find("stack traceback") != string::npos);
+	
+	bool threw = false;
+	try
+	{
+		FunctionHandle<void()> notfunc = state["ticks"];
+	}
+	catch(const RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	
+	// Type stays an unscoped enum next to the handle
+	check(state["tick"].GetType() == Lua::Function);
+	check(state["nothing"].GetType() == Lua::Nil);
+	check(state["ticks"].GetType() == LUA_TNUMBER);
+	
+	return true;
+}
+
+bool test_globals()
+{
+	State state;
+	CHECK_STACK;
+	
+	// reading and writing globals takes no registry slots
+	size_t peak = state.GetPeakReferences();
+	for(int i = 0; i < 1000; i++)
+	{
+		state["counter"] = i;
+		check(state["counter"].As<int>() == i);
+	}
+	check(state.GetPeakReferences() == peak);
+	check(state.GetEnviroment()["counter"] == 999);
+	check(state.GetRegistry()[LUA_RIDX_GLOBALS] == state.GetEnviroment());
+	
+	Global<double> gravity(&state, "gravity");
+	check(gravity.IsNil());
+	gravity = 9.81;
+	check(state["gravity"] == 9.81);
+	state.DoString("gravity = gravity * 2");
+	check(gravity.Get() == 19.62);
+	
+	Global<string> name(&state, "name");
+	state.DoString("name = 'player'");
+	string value = name;
+	check(value == "player");
+	
+	// keys are pushed with their length, so embedded NULs don't alias a shorter name
+	string nul_key("a\0b", 3);
+	state[nul_key] = 1;
+	state["a"] = 2;
+	check(state[nul_key] == 1);
+	check(state["a"] == 2);
+	lua_rawgeti(state, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	lua_pushlstring(state, nul_key.data(), nul_key.size());
+	lua_rawget(state, -2);
+	check(lua_tointeger(state, -1) == 1);
+	lua_pop(state, 2);
+	
+	return true;
+}
+
+bool test_shared_metatables()
+{
+	struct Vec2
+	{
+		float x, y;
+	};
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	Variable a(&state, Vec2{ 1, 2 });
+	Variable b(&state, Vec2{ 3, 4 });
+	check(a.MetaTable() == b.MetaTable());
+	check(a.MetaTable()["__gc"].IsNil());
+	check(b.As<Vec2>().y == 4);
+	
+	Variable c(&state, std::make_shared<int>(5));
+	Variable d(&state, std::make_shared<int>(6));
+	check(c.MetaTable() == d.MetaTable());
+	check(c.MetaTable()["__gc"].GetType() == Type::Function);
+	check(c.MetaTable() != a.MetaTable());
+	
+	// the metatable is hidden from scripts, and a __gc called by hand only destroys once
+	std::shared_ptr<int> owner = std::make_shared<int>(7);
+	state["owned"] = Variable(&state, owner);
+	state.DoString("hidden = getmetatable(owned)");
+	check(state["hidden"] == "object");
+	Variable gc = c.MetaTable()["__gc"];
+	gc(state["owned"]);
+	gc(state["owned"]);
+	check(owner.use_count() == 1);
+	check(!state["owned"].Is<std::shared_ptr<int>>() || !state["owned"].As<std::shared_ptr<int>>());
+	state["owned"] = nullptr;
+	lua_gc(state, LUA_GCCOLLECT, 0);
+	check(owner.use_count() == 1);
+	
+	return true;
+}
+
+bool test_shared_objects()
+{
+	struct Entity
+	{
+		int health;
+		void Damage(int amount)
+		{
+			health -= amount;
+		}
+		int GetHealth()
+		{
+			return health;
+		}
+	};
+	State state;
+	CHECK_STACK;
+	
+	state.GetMethods<Entity>()["Damage"] = Variable::FromMemberFunction(&state, &Entity::Damage);
+	state.GetMethods<Entity>()["GetHealth"] = Variable::FromMemberFunction(&state, &Entity::GetHealth);
+	
+	std::shared_ptr<Entity> player = std::make_shared<Entity>(Entity{ 100 });
+	state["player"] = state.GeneratePointer(player);
+	state["other"] = std::make_shared<Entity>(Entity{ 50 });
+	check(player.use_count() == 2);
+	
+	state.DoString("player:Damage(30) other:Damage(other:GetHealth())");
+	check(player->health == 70);
+	check(state["other"].As<std::shared_ptr<Entity>>()->health == 0);
+	check(Variable(state["player"]).MetaTable() == Variable(state["other"]).MetaTable());
+	
+	// objects pushed by value share the methods
+	state["copy"] = Entity{ 10 };
+	state.DoString("copy:Damage(1)");
+	check(state["copy"].As<Entity>().health == 9);
+	check(!state["copy"].Is<std::shared_ptr<Entity>>());
+	
+	state.DoString("player = nil");
+	state.CollectReferences();
+	lua_gc(state, LUA_GCCOLLECT, 0);
+	check(player.use_count() == 1);
+	
+	return true;
+}
+
+struct Vehicle
+{
+	int speed;
+	string name;
+	
+	Vehicle(int speed) : speed(speed), name("car") {}
+	void Accelerate(int amount)
+	{
+		speed += amount;
+	}
+	int GetSpeed() const
+	{
+		return speed;
+	}
+	static int Wheels()
+	{
+		return 4;
+	}
+};
+
+bool test_register_class()
+{
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	state.RegisterClass<Vehicle>("Vehicle")
+		.Constructor<int>()
+		.Method<LUAPP_FUNC(&Vehicle::Accelerate)>("Accelerate")
+		.Method<LUAPP_FUNC(&Vehicle::GetSpeed)>("GetSpeed")
+		.Static<LUAPP_FUNC(&Vehicle::Wheels)>("Wheels")
+		.Property<LUAPP_FUNC(&Vehicle::speed)>("speed");
+	
+	state.DoString("car = Vehicle.new(10) car:Accelerate(5) speed = car:GetSpeed() wheels = Vehicle.Wheels()");
+	check(state["speed"] == 15);
+	check(state["wheels"] == 4);
+	check(state["car"].As<Vehicle>().speed == 15);
+	
+	state.DoString("car.speed = car.speed * 2");
+	check(state["car"].As<Vehicle>().speed == 30);
+	state.DoString("ok = pcall(function() car.missing = 1 end)");
+	check(state["ok"] == false);
+	
+	// objects shared from C++ get the same members
+	std::shared_ptr<Vehicle> bus = std::make_shared<Vehicle>(1);
+	state["bus"] = bus;
+	state.DoString("bus:Accelerate(bus.speed)");
+	check(bus->speed == 2);
+	
+#if __cplusplus >= 201703L
+	state.RegisterClass<Vehicle>()
+		.Property<&Vehicle::name>("name");
+	state.DoString("bus.name = 'bus' name = car.name");
+	check(bus->name == "bus");
+	check(state["name"] == "car");
+#endif
+	
+	return true;
+}
+
+int scale(int value, int factor)
+{
+	return value * factor;
+}
+
+bool test_bind()
+{
+	State state;
+	CHECK_STACK;
+	
+	state["scale"] = Bind<LUAPP_FUNC(&scale)>();
+	state["wheels"] = Bind<LUAPP_FUNC(&Vehicle::Wheels)>();
+	state["accelerate"] = Bind<LUAPP_FUNC(&Vehicle::Accelerate)>();
+	state["car"] = Vehicle(5);
+	
+	state.DoString("scaled = scale(3, 7) count = wheels() accelerate(car, 10)");
+	check(state["scaled"] == 21);
+	check(state["count"] == 4);
+	check(state["car"].As<Vehicle>().speed == 15);
+	
+	// a bare lua_CFunction, usable straight with the C API
+	lua_CFunction func = Bind<LUAPP_FUNC(&scale)>();
+	check(state["scale"].As<lua_CFunction>() == func);
+	lua_pushcfunction(state, func);
+	lua_pushinteger(state, 2);
+	lua_pushinteger(state, 4);
+	lua_call(state, 2, 1);
+	check(lua_tointeger(state, -1) == 8);
+	lua_pop(state, 1);
+	
+#if __cplusplus >= 201703L
+	static_assert(Bind<&scale>() == Bind<LUAPP_FUNC(&scale)>(), "both forms bind the same function");
+#endif
+	
+	return true;
+}
+
+bool test_callables()
+{
+	State state;
+	CHECK_STACK;
+	
+	int hits = 0;
+	state["hit"] = [&hits](int damage) { hits += damage; };
+	state["twice"] = [](int x) { return x * 2; };
+	
+	int calls = 0;
+	state["next"] = [calls]() mutable { return ++calls; };
+	
+	std::shared_ptr<int> captured = std::make_shared<int>(7);
+	state["peek"] = [captured]() { return *captured; };
+	check(captured.use_count() == 2);
+	
+	state["add"] = Callable<int(int)>(std::bind(std::plus<int>(), std::placeholders::_1, 10));
+	
+	state.DoString("hit(3) hit(4) doubled = twice(21) next() counted = next() peeked = peek() added = add(5)");
+	check(hits == 7);
+	check(state["doubled"] == 42);
+	check(state["counted"] == 2);
+	check(state["peeked"] == 7);
+	check(state["added"] == 15);
+	check(state["hit"].GetType() == Type::Function);
+	
+	// the closure's copy is destroyed with it
+	state.DoString("peek = nil");
+	state.CollectReferences();
+	lua_gc(state, LUA_GCCOLLECT, 0);
+	check(captured.use_count() == 1);
+	
+	return true;
+}
+
+std::tuple<int, int> divmod(int a, int b)
+{
+	return std::make_tuple(a / b, a % b);
+}
+
+std::pair<string, bool> lookup(int id)
+{
+	return std::make_pair(id == 1 ? "admin" : "", id == 1);
+}
+
+bool test_multiple_returns()
+{
+	State state;
+	CHECK_STACK;
+	
+	state["divmod"] = Bind<LUAPP_FUNC(&divmod)>();
+	state["divmod_stored"] = Variable::FromFunction(&state, &divmod);
+	state["lookup"] = [](int id) { return lookup(id); };
+	
+	state.DoString("q, r = divmod(17, 5) q2, r2 = divmod_stored(9, 4) name, found = lookup(1)");
+	check(state["q"] == 3 && state["r"] == 2);
+	check(state["q2"] == 2 && state["r2"] == 1);
+	check(state["name"] == "admin" && state["found"] == true);
+	
+	// results land on the stack, not in a table
+	lua_pushcfunction(state, Bind<LUAPP_FUNC(&divmod)>());
+	lua_pushinteger(state, 7);
+	lua_pushinteger(state, 2);
+	lua_call(state, 2, LUA_MULTRET);
+	check(lua_gettop(state) == 2);
+	lua_pop(state, 2);
+	
+#if __cplusplus >= 201703L
+	state["find"] = [](int id) -> std::optional<string> {
+		if(id == 1)
+			return string("admin");
+		return std::nullopt;
+	};
+	state.DoString("found, missing = find(1), find(2)");
+	check(state["found"] == "admin");
+	check(state["missing"].IsNil());
+	check(!state["missing"].As<std::optional<int>>());
+	check(*state["found"].As<std::optional<string>>() == "admin");
+#endif
+	
+	return true;
+}
+
+bool test_type_tags()
+{
+	struct Vec2
+	{
+		float x, y;
+	};
+	State state;
+	state.LoadStandardLibary();
+	CHECK_STACK;
+	
+	state.RegisterClass<Vehicle>("Vehicle")
+		.Method<LUAPP_FUNC(&Vehicle::Accelerate)>("Accelerate");
+	state["speedof"] = [](const Vehicle& v) { return v.speed; };
+	state["car"] = Vehicle(3);
+	state["vec"] = Vec2{ 1, 2 };
+	
+	check(state["car"].Is<Vehicle>() && !state["car"].Is<Vec2>());
+	check(state["vec"].Is<Vec2>() && !state["vec"].Is<Vehicle>());
+	check(state["car"].As<Vehicle*>() != nullptr && state["vec"].As<Vehicle*>() == nullptr);
+	
+	// the wrong object is a Lua error rather than a bad cast
+	state.DoString("ok = pcall(Vehicle.Accelerate, vec, 1) ok2 = pcall(speedof, vec) speed = speedof(car)");
+	check(state["ok"] == false);
+	check(state["ok2"] == false);
+	check(state["speed"] == 3);
+	check(state["vec"].As<Vec2>().y == 2);
+	
+	bool threw = false;
+	try
+	{
+		state["vec"].As<Vehicle>();
+	}
+	catch(RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	
+	return true;
+}
+
+bool test_allocators()
+{
+	const char* churn = "local t = {} for i = 1, 2000 do t[i] = { 'k' .. i, i * 2 } end";
+	
+	MallocAllocator heap;
+	PoolAllocator pool;
+	ArenaAllocator arena(16 * 1024);
+	{
+		State a(heap), b(pool), c(arena);
+		a.DoString(churn);
+		b.DoString(churn);
+		c.DoString(churn);
+		lua_gc(a, LUA_GCCOLLECT, 0);
+		lua_gc(b, LUA_GCCOLLECT, 0);
+		lua_gc(c, LUA_GCCOLLECT, 0);
+		b["x"] = string(300, 'x'); // larger than the pooled sizes
+		check(b["x"].As<string>().size() == 300);
+		
+		check(heap.GetLiveBytes() > 0 && heap.GetPeakBytes() > heap.GetLiveBytes());
+		check(heap.GetTotalBytes() >= heap.GetPeakBytes());
+		check(pool.GetPeakBytes() > pool.GetLiveBytes() && arena.GetPeakBytes() > arena.GetLiveBytes());
+	}
+	check(heap.GetLiveBytes() == 0 && pool.GetLiveBytes() == 0 && arena.GetLiveBytes() == 0);
+	
+	MallocAllocator limited;
+	State state(limited);
+	CHECK_STACK;
+	limited.SetLimit(limited.GetLiveBytes() + 64 * 1024);
+	
+	bool threw = false;
+	try
+	{
+		state.DoString("local t = {} for i = 1, 100000 do t[i] = {} end");
+	}
+	catch(RuntimeError& e)
+	{
+		threw = string(e.what()).find("not enough memory") != string::npos;
+	}
+	check(threw);
+	check(limited.GetLiveBytes() <= limited.GetLimit());
+	
+	// the state is still usable once the garbage is gone
+	lua_gc(state, LUA_GCCOLLECT, 0);
+	state.DoString("x = 1 + 2");
+	check(state["x"] == 3);
+	
+	MallocAllocator tiny;
+	tiny.SetLimit(64);
+	threw = false;
+	try
+	{
+		State starved(tiny);
+	}
+	catch(RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	
+	// every limit short of what setup needs is an error, never a panic, wherever it runs out
+	size_t limit = 64;
+	for(bool made = false; !made; limit += 64)
+	{
+		MallocAllocator tight;
+		tight.SetLimit(limit);
+		try
+		{
+			State state(tight);
+			made = true;
+		}
+		catch(RuntimeError&)
+		{
+		}
+		check(tight.GetLiveBytes() == 0);
+	}
+	
+	return true;
+}
+
+bool test_state_pool()
+{
+	StatePool pool(2, [](State& state)
+	{
+		state.LoadStandardLibary();
+		state.DoString("greeting = 'hello' function greet(name) return greeting .. ' ' .. name end");
+	});
+	check(pool.GetCreated() == 2);
+	
+	State* first;
+	{
+		StatePool::Lease lease = pool.Acquire();
+		first = lease.Get();
+		check((*lease)["greet"]("bob").First().As<string>() == "hello bob");
+		lease->DoString("leaked = {} greeting = 'bye' greet = nil setmetatable(_G, { __index = function() return 1 end })");
+		lease->DoString("string.shout = string.upper string.rep = nil package.loaded.fake = {} math.pi = 3");
+		Variable kept = (*lease)["leaked"];
+	}
+	{
+		StatePool::Lease a = pool.Acquire();
+		StatePool::Lease b = pool.Acquire();
+		State& state = a.Get() == first ? *a : *b;
+		check(state["leaked"].IsNil());
+		check(state["anything"].IsNil());
+		check(state["greet"]("amy").First().As<string>() == "hello amy");
+		
+		// library tables and package.loaded are put back too
+		state.DoString("restored = string.shout == nil and string.rep ~= nil and package.loaded.fake == nil and math.pi > 3.14");
+		check(state["restored"] == true);
+		check(state.GetLiveReferences() == 2);
+		
+		// more leases than slots: made on demand, and dropped when the pool is full again
+		StatePool::Lease c = pool.Acquire();
+		check(pool.GetCreated() == 3);
+	}
+	
+	// a handle outliving its lease keeps the state away from the next tenant, the pool deletes it later
+	State* abandoned;
+	{
+		std::unique_ptr<Variable> kept;
+		{
+			StatePool::Lease lease = pool.Acquire();
+			abandoned = lease.Get();
+			lease->DoString("secret = { 'tenant data' }");
+			kept.reset(new Variable((*lease)["secret"]));
+		}
+		check(pool.GetAbandoned() == 1);
+		StatePool::Lease a = pool.Acquire();
+		StatePool::Lease b = pool.Acquire();
+		check(a.Get() != abandoned && b.Get() != abandoned);
+	}
+	
+	// a setup that throws part way through the fill leaves nothing behind
+	int made = 0;
+	bool threw = false;
+	try
+	{
+		StatePool failing(3, [&made](State&)
+		{
+			if(++made == 2)
+				throw std::runtime_error("setup failed");
+		});
+	}
+	catch(const std::runtime_error&)
+	{
+		threw = true;
+	}
+	check(threw && made == 2);
+	
+	std::vector<std::thread> threads;
+	std::atomic<int> total(0);
+	for(int t = 0; t < 4; t++)
+	{
+		threads.emplace_back([&]()
+		{
+			for(int i = 0; i < 200; i++)
+			{
+				StatePool::Lease lease = pool.Acquire();
+				lease->DoString("count = (count or 0) + 1");
+				total += (*lease)["count"].As<int>();
+			}
+		});
+	}
+	for(std::thread& thread : threads)
+		thread.join();
+	check(total == 800); // every lease starts from the baseline, where count is nil
+	
+	return true;
+}
+
+bool test_executor()
+{
+	std::vector<std::future<int>> scores;
+	std::future<void> failing;
+	std::future<string> named;
+	std::future<string> copied;
+	std::future<std::future<int>> nested;
+	{
+		Executor executor(4, [](State& state)
+		{
+			state.LoadStandardLibary();
+			state.DoString("function score(a, b) return a * b end function fail() error('nope') end function echo(s) return s end");
+		});
+		check(executor.GetWorkers() == 4);
+		
+		for(int i = 0; i < 1000; i++)
+			scores.push_back(executor.Call<int>("score", i, 2));
+		failing = executor.Call("fail");
+		named = executor.Submit([](State& state)
+		{
+			state.DoString("name = 'worker'");
+			return state["name"].As<string>();
+		});
+		
+		// C strings are copied when the job is made, not read when it runs
+		char buffer[16] = "alice";
+		copied = executor.Call<string>("echo", buffer);
+		std::strcpy(buffer, "bob");
+		
+		// jobs submitted from a job, handed back rather than waited on
+		nested = executor.Submit([&executor](State&)
+		{
+			return executor.Call<int>("score", 3, 3);
+		});
+	} // the rest run before the workers are joined
+	
+	check(copied.get() == "alice");
+	check(nested.get().get() == 9);
+	
+	bool ok = true;
+	for(int i = 0; i < 1000; i++)
+		ok = ok && scores[i].get() == i * 2;
+	check(ok);
+	check(named.get() == "worker");
+	
+	bool threw = false;
+	try
+	{
+		failing.get();
+	}
+	catch(RuntimeError& e)
+	{
+		threw = string(e.what()).find("nope") != string::npos;
+	}
+	check(threw);
+	
+	// with one worker a job waiting on its own nested jobs runs them itself, rather than deadlocking;
+	// the worker's State is shared by every job it runs, so globals carry over
+	Executor single(1, [](State& state)
+	{
+		state.DoString("function score(a, b) return a * b end");
+	});
+	std::future<int> outer = single.Submit([&single](State& state)
+	{
+		state.DoString("seen = 1");
+		std::future<int> inner = single.Submit([&single](State& state)
+		{
+			std::future<int> deepest = single.Call<int>("score", 2, 5);
+			single.Wait(deepest);
+			return deepest.get() + state["seen"].As<int>();
+		});
+		single.Wait(inner);
+		return inner.get();
+	});
+	single.Wait(outer);
+	check(outer.get() == 11);
+	check(single.Submit([](State& state) { return state["seen"].As<int>(); }).get() == 1);
+	
+	return true;
+}
+
+bool test_serializer()
+{
+	struct Vec2
+	{
+		float x, y;
+	};
+	Serializer::Register<Vec2>("Vec2");
+	
+	State from, to;
+	from.LoadStandardLibary();
+	to.LoadStandardLibary();
+	StackCheck _check(from);
+	from["pos"] = Vec2{ 3, 4 };
+	from.DoString(R"(
+		shared = { 'shared' }
+		payload = {
+			1, -2, 1.5, 'a\0b', true, false, [10] = 'sparse',
+			name = 'job', pos = pos, a = shared, b = shared, nested = { deep = { 42 } }
+		}
+		payload.self = payload
+	)");
+#if LUA_VERSION_NUM >= 503
+	from.DoString("payload[7] = math.mininteger payload[8] = math.maxinteger");
+#endif
+	
+	string bytes = Serializer::Encode(from["payload"]);
+	to["payload"] = Serializer::Decode(&to, bytes);
+	to.DoString(R"(
+		local p = payload
+		ok = p[1] == 1 and p[2] == -2 and p[3] == 1.5 and p[4] == 'a\0b' and p[5] == true and p[6] == false
+			and p[10] == 'sparse' and p.name == 'job' and p.nested.deep[1] == 42
+			and p.self == p and p.a == p.b and p.a[1] == 'shared'
+	)");
+	check(to["ok"] == true);
+#if LUA_VERSION_NUM >= 503
+	// integers stay integers, out to the ends of their range; before 5.3 every number is a float
+	to.DoString(R"(
+		local p = payload
+		ints = math.type(p[1]) == 'integer' and math.type(p[2]) == 'integer' and math.type(p[3]) == 'float'
+			and p[7] == math.mininteger and p[8] == math.maxinteger
+	)");
+	check(to["ints"] == true);
+#endif
+	check(to["payload"]["pos"].As<Vec2>().y == 4);
+	
+	// what can't be moved is an error, and the stack is left as it was
+	bool threw = false;
+	try
+	{
+		Serializer::Encode(from["print"]);
+	}
+	catch(RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	
+	threw = false;
+	try
+	{
+		Serializer::Decode(&to, bytes.substr(0, bytes.size() / 2));
+	}
+	catch(RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	check(lua_gettop(to) == 0);
+	
+	auto rejects = [&](const string& data)
+	{
+		try
+		{
+			Serializer::Decode(&to, data);
+		}
+		catch(RuntimeError&)
+		{
+			return lua_gettop(to) == 0;
+		}
+		return false;
+	};
+	
+	// a NaN key would be a Lua error inside lua_rawset
+	double nan = std::numeric_limits<double>::quiet_NaN();
+	string nan_key("\x06\x00\x01\x00\x00\x00\x04", 7);
+	nan_key.append(reinterpret_cast<const char*>(&nan), sizeof(nan));
+	nan_key.push_back('\x02');
+	check(rejects(nan_key));
+	
+	// nesting is bounded on both sides rather than running out of C++ stack
+	string deep;
+	for(int i = 0; i < 100000; i++)
+		deep.append("\x06\x01\x00\x00\x00\x00", 6);
+	deep.push_back('\x00');
+	check(rejects(deep));
+	
+	from.DoString("deep = {} for i = 1, 1000 do deep = { deep } end shallow = {} for i = 1, 100 do shallow = { shallow } end");
+	threw = false;
+	try
+	{
+		Serializer::Encode(from["deep"]);
+	}
+	catch(RuntimeError&)
+	{
+		threw = true;
+	}
+	check(threw);
+	check(Serializer::Decode(&to, Serializer::Encode(from["shallow"])).GetType() == Type::Table);
+	
+	return true;
+}
+
+// removes the files a test or benchmark wrote, however it returns
+struct RemoveFiles
+{
+	std::vector<string> Paths;
+	~RemoveFiles()
+	{
+		for(const string& path : Paths)
+			std::remove(path.c_str());
+	}
+};
+
+bool test_bytecode_cache()
+{
+	const string script = "luapp_cache_test.lua";
+	BytecodeCache cache(".");
+	string entry = cache.GetEntryPath(script);
+	RemoveFiles cleanup = { { script, entry } };
+	
+	auto write = [&](const string& code)
+	{
+		std::ofstream file(script, std::ios::binary | std::ios::trunc);
+		file << code;
+	};
+	write("#!/usr/bin/env lua\nx = (x or 0) + 1\nfunction fail() error('line three') end\n");
+	std::remove(entry.c_str());
+	{
+		State state;
+		state.LoadStandardLibary();
+		state.SetBytecodeCache(&cache);
+		state.DoFile(script);
+		check(cache.GetMisses() == 1 && cache.GetHits() == 0);
+		
+		state.DoFile(script);
+		check(state["x"] == 2);
+		check(cache.GetMisses() == 1 && cache.GetHits() == 1);
+		
+		// compiled with its debug info, so errors still point at the file and line
+		bool threw = false;
+		try
+		{
+			state["fail"]();
+		}
+		catch(RuntimeError& e)
+		{
+			threw = string(e.what()).find("luapp_cache_test.lua:3:") != string::npos;
+		}
+		check(threw);
+	}
+	
+	// a damaged entry is noticed and written again
+	{
+		std::fstream file(entry, std::ios::binary | std::ios::in | std::ios::out);
+		file.seekp(-1, std::ios::end);
+		file.put('\x7f');
+	}
+	State state;
+	state.SetBytecodeCache(&cache);
+	state.DoFile(script);
+	check(state["x"] == 1);
+	check(cache.GetRebuilds() == 1 && cache.GetMisses() == 2);
+	state.DoFile(script);
+	check(cache.GetHits() == 2);
+	
+	// as is a changed file, which replaces its entry rather than adding one
+	write("x = 10");
+	state.DoFile(script);
+	check(state["x"] == 10);
+	check(cache.GetRebuilds() == 2 && cache.GetMisses() == 3);
+	state.DoFile(script);
+	check(cache.GetHits() == 3);
+	
+	// what can't be read is Lua's error, as without the cache
+	bool threw = false;
+	try
+	{
+		state.LoadFile(".");
+	}
+	catch(CompileError& e)
+	{
+		threw = string(e.what()).find("cannot read") != string::npos;
+	}
+	check(threw);
+	
+	return true;
+}
+
 bool failed;
 void test(const std::string& what, std::function<bool()> func)
 {
@@ -163,10 +1392,321 @@ void test()
 	test("Exceptions on runtime lua", test_error_runtime);
 	test("C++ object manipulate", test_cppobject);
 	test("C++ function manipulate", test_cppfunction);
+	test("Variable layout", test_variable_layout);
+	test("Table path proxies", test_proxy);
+	test("Reference pool", test_reference_pool);
+	test("Stack views", test_stackref);
+	test("Strings", test_strings);
+	test("Integers", test_integers);
+	test("Table iteration", test_iteration);
+	test("Array conversions", test_arrays);
+	test("Map conversions", test_maps);
+	test("Buffers", test_buffer);
+	test("Typed calls", test_typed_call);
+	test("Function handles", test_function);
+	test("Globals", test_globals);
+	test("Shared metatables", test_shared_metatables);
+	test("Shared objects", test_shared_objects);
+	test("Class registration", test_register_class);
+	test("Bound functions", test_bind);
+	test("Callables", test_callables);
+	test("Multiple returns", test_multiple_returns);
+	test("Type tags", test_type_tags);
+	test("Allocators", test_allocators);
+	test("State pool", test_state_pool);
+	test("Executor", test_executor);
+	test("Serializer", test_serializer);
+	test("Bytecode cache", test_bytecode_cache);
+}
+
+// benchmarks
+// the pre-compaction Variable layout, kept here to compare against
+struct LegacyVariable
+{
+	Type                       _Type;
+	State*                     _State;
+	std::shared_ptr<Variable>  _Key;
+	std::shared_ptr<Reference> _KeyTo;
+	bool                       _Global;
+	bool                       _Registry;
+	bool                       _IsReference;
+	std::shared_ptr<Reference> Ref;
+	string                     String;
+	union {
+		int Integer;
+		double Real;
+		bool Boolean;
+		void* Pointer;
+	} Data;
+};
+
+template<typename T>
+double bench_copies(const T& value, size_t count)
+{
+	std::vector<T> copies;
+	copies.reserve(count);
+	
+	auto start = std::chrono::high_resolution_clock::now();
+	for(size_t i = 0; i < count; i++)
+		copies.push_back(value);
+	auto end = std::chrono::high_resolution_clock::now();
+	
+	return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+void bench_variable_layout()
+{
+	const size_t count = 1000000;
+	State state;
+	
+	Variable table(&state, Type::Table);
+	LegacyVariable legacy_table;
+	legacy_table._Type = Type::Table;
+	legacy_table._KeyTo = std::shared_ptr<Reference>(nullptr, [](Reference*){});
+	legacy_table.Ref = std::shared_ptr<Reference>(nullptr, [](Reference*){});
+	legacy_table._Key = std::make_shared<Variable>(&state, "key");
+	
+	Variable str(&state, "entity_name");
+	LegacyVariable legacy_str;
+	legacy_str._Type = Type::String;
+	legacy_str.String = "entity_name";
+	
+	cout << "sizeof(Variable): " << sizeof(Variable) << " bytes (legacy: " << sizeof(LegacyVariable) << " bytes)\n";
+	cout << "copy table: " << bench_copies(table, count) << " ns (legacy: " << bench_copies(legacy_table, count) << " ns)\n";
+	cout << "copy short string: " << bench_copies(str, count) << " ns (legacy: " << bench_copies(legacy_str, count) << " ns)\n";
+}
+
+template<typename Func>
+double bench_loop(size_t count, Func func)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	for(size_t i = 0; i < count; i++)
+		func(i);
+	auto end = std::chrono::high_resolution_clock::now();
+	
+	return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+void bench_calls()
+{
+	const size_t count = 1000000;
+	State state;
+	state.DoString("function add(a, b) return a + b end");
+	
+	int total = 0;
+	cout << "call, ReturnValue: " << bench_loop(count, [&](size_t i) {
+		total += state["add"](static_cast<int>(i), 1).First().As<int>();
+	}) << " ns\n";
+	cout << "call, Call<int>: " << bench_loop(count, [&](size_t i) {
+		total += state["add"].Call<int>(static_cast<int>(i), 1);
+	}) << " ns\n";
+	FunctionHandle<int(int, int)> add = state["add"];
+	cout << "call, FunctionHandle<int(int, int)>: " << bench_loop(count, [&](size_t i) {
+		total += add(static_cast<int>(i), 1);
+	}) << " ns\n";
+}
+
+void bench_globals()
+{
+	const size_t count = 1000000;
+	State state;
+	state["gravity"] = 9.81;
+	
+	double total = 0;
+	cout << "global read, state[]: " << bench_loop(count, [&](size_t) {
+		total += state["gravity"].As<double>();
+	}) << " ns\n";
+	Global<double> gravity(&state, "gravity");
+	cout << "global read, Global<double>: " << bench_loop(count, [&](size_t) {
+		total += gravity;
+	}) << " ns\n";
+}
+
+void bench_userdata()
+{
+	struct Vec2
+	{
+		float x, y;
+	};
+	const size_t count = 1000000;
+	State state;
+	
+	cout << "push value userdata: " << bench_loop(count, [&](size_t i) {
+		Extensions::AllowedType<Vec2>::Push(state, Vec2{ static_cast<float>(i), 0 });
+		lua_pop(state, 1);
+	}) << " ns\n";
+	
+	std::shared_ptr<Vec2> shared = std::make_shared<Vec2>();
+	cout << "push shared object: " << bench_loop(count, [&](size_t) {
+		Variable obj = state.GeneratePointer(shared);
+	}) << " ns\n";
+}
+
+void bench_methods()
+{
+	const size_t count = 1000000;
+	State state;
+	state.GetMethods<Vehicle>()["Upvalue"] = Variable::FromMemberFunction(&state, &Vehicle::Accelerate);
+	state.RegisterClass<Vehicle>()
+		.Method<LUAPP_FUNC(&Vehicle::Accelerate)>("Accelerate");
+	state["car"] = Vehicle(0);
+	state.LoadString("for i = 1, 1000000 do car:Upvalue(1) end");
+	Variable upvalue = Variable::FromStack(&state);
+	state.LoadString("for i = 1, 1000000 do car:Accelerate(1) end");
+	Variable dispatch = Variable::FromStack(&state);
+	
+	cout << "method call, FromMemberFunction: " << bench_loop(1, [&](size_t) { upvalue(); }) / count << " ns\n";
+	cout << "method call, RegisterClass: " << bench_loop(1, [&](size_t) { dispatch(); }) / count << " ns\n";
+	
+	state["stored"] = Variable::FromFunction(&state, &scale);
+	state["bound"] = Bind<LUAPP_FUNC(&scale)>();
+	state.LoadString("for i = 1, 1000000 do stored(i, 2) end");
+	Variable stored = Variable::FromStack(&state);
+	state.LoadString("for i = 1, 1000000 do bound(i, 2) end");
+	Variable bound = Variable::FromStack(&state);
+	
+	cout << "function call, FromFunction: " << bench_loop(1, [&](size_t) { stored(); }) / count << " ns\n";
+	cout << "function call, Bind: " << bench_loop(1, [&](size_t) { bound(); }) / count << " ns\n";
+}
+
+void bench_allocators()
+{
+	const size_t count = 50;
+	const char* churn = "local t = {} for i = 1, 20000 do t[i] = { i, 'k' .. i } end";
+	
+	cout << "table churn, luaL_newstate: " << bench_loop(count, [&](size_t) {
+		State state;
+		state.DoString(churn);
+	}) / 1000 << " us\n";
+	cout << "table churn, PoolAllocator: " << bench_loop(count, [&](size_t) {
+		PoolAllocator pool;
+		State state(pool);
+		state.DoString(churn);
+	}) / 1000 << " us\n";
+	cout << "table churn, ArenaAllocator: " << bench_loop(count, [&](size_t) {
+		ArenaAllocator arena;
+		State state(arena);
+		state.DoString(churn);
+	}) / 1000 << " us\n";
+}
+
+void bench_state_pool()
+{
+	const size_t count = 1000;
+	auto setup = [](State& state)
+	{
+		state.LoadStandardLibary();
+		state.DoString("prelude = {} for i = 1, 1000 do prelude[i] = { name = 'item' .. i } end");
+	};
+	
+	cout << "request, new State: " << bench_loop(count, [&](size_t) {
+		State state;
+		setup(state);
+		state.DoString("x = #prelude");
+	}) / 1000 << " us\n";
+	StatePool pool(4, setup);
+	cout << "request, StatePool: " << bench_loop(count, [&](size_t) {
+		StatePool::Lease lease = pool.Acquire();
+		lease->DoString("x = #prelude");
+	}) / 1000 << " us\n";
+}
+
+void bench_executor()
+{
+	const int count = 64;
+	auto setup = [](State& state)
+	{
+		state.DoString("function score(n) local s = 0 for i = 1, n do s = s + i % 7 end return s end");
+	};
+	
+	State state;
+	setup(state);
+	FunctionHandle<int(int)> score = state["score"];
+	long long total = 0;
+	cout << "batch score, one State: " << bench_loop(1, [&](size_t) {
+		for(int i = 0; i < count; i++)
+			total += score(200000);
+	}) / 1000000 << " ms\n";
+	
+	Executor executor(std::thread::hardware_concurrency(), setup);
+	cout << "batch score, Executor(" << executor.GetWorkers() << "): " << bench_loop(1, [&](size_t) {
+		std::vector<std::future<int>> results;
+		for(int i = 0; i < count; i++)
+			results.push_back(executor.Call<int>("score", 200000));
+		for(std::future<int>& result : results)
+			total += result.get();
+	}) / 1000000 << " ms\n";
+}
+
+void bench_serializer()
+{
+	const size_t count = 100;
+	State from, to;
+	from.DoString("payload = {} for i = 1, 10000 do payload[i] = { id = i, score = i * 0.5, name = 'item' .. i } end");
+	Variable payload = from["payload"];
+	
+	string bytes;
+	double encode = bench_loop(count, [&](size_t) {
+		bytes.clear();
+		lua_State* L = from;
+		payload.Push();
+		Serializer::Encode(L, -1, bytes);
+		lua_pop(L, 1);
+	});
+	double decode = bench_loop(count, [&](size_t) {
+		Serializer::Decode(to, bytes.data(), bytes.size());
+		lua_pop(to, 1);
+	});
+	cout << "serialize 10k records: " << encode / 1000 << " us (" << bytes.size() / encode * 1000 << " MB/s), ";
+	cout << "deserialize: " << decode / 1000 << " us (" << bytes.size() / decode * 1000 << " MB/s)\n";
+}
+
+void bench_bytecode_cache()
+{
+	const size_t count = 100;
+	const string script = "luapp_cache_bench.lua";
+	BytecodeCache cache(".");
+	RemoveFiles cleanup = { { script, cache.GetEntryPath(script) } };
+	{
+		std::ofstream file(script, std::ios::binary | std::ios::trunc);
+		for(int i = 0; i < 2000; i++)
+			file << "function f" << i << "(a, b) local t = { a, b, name = 'f" << i << "' } if a > b then return t else return #t end end\n";
+	}
+	
+	State state;
+	cout << "load 2000 functions, luaL_loadfile: " << bench_loop(count, [&](size_t) {
+		state.LoadFile(script);
+		lua_pop(state, 1);
+	}) / 1000 << " us\n";
+	state.SetBytecodeCache(&cache);
+	cout << "load 2000 functions, BytecodeCache: " << bench_loop(count, [&](size_t) {
+		state.LoadFile(script);
+		lua_pop(state, 1);
+	}) / 1000 << " us\n";
+}
+
+void bench()
+{
+	bench_variable_layout();
+	bench_calls();
+	bench_globals();
+	bench_userdata();
+	bench_methods();
+	bench_allocators();
+	bench_state_pool();
+	bench_executor();
+	bench_serializer();
+	bench_bytecode_cache();
 }
 
 int main(int argc, char** argv)
 {
+	if(argc > 1 && string(argv[1]) == "--bench")
+	{
+		bench();
+		return 0;
+	}
+	
 	test();
-	return 0;
+	return failed ? 1 : 0;
 }